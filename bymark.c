@@ -1,15 +1,48 @@
+void bymark_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w);
+
+/* rule from config: packets with (mark & mask) == value get weight w */
+struct mark_rule
+{
+	uint32_t value, mask;
+	double w;
+};
+
+/* hash table entry */
 struct mark_weight
 {
-	int mark;
+	uint32_t mark;
+	int used;
 	double w;
 };
 
+/* all rules with the same mask */
+struct mark_group
+{
+	uint32_t mask;
+
+	/* direct-index array for dense range of values, NAN if there is no rule */
+	uint32_t base;
+	size_t nvals;
+	double *direct;
+
+	/* or open addressing hash table */
+	struct mark_weight *hash;
+	size_t hsize;              /* power of 2 */
+};
+
+#define BYMARK_DIRECT_MAX (1 << 20) /* maximum size of direct-index array */
+
 struct bymark
 {
 	size_t module_number;
 
-	size_t nmarks;
-	struct mark_weight *mw;
+	/* rules from config */
+	size_t nrules, rules_alloc;
+	struct mark_rule *rules;
+
+	/* lookup tables, groups with longer masks first */
+	size_t ngroups;
+	struct mark_group *groups;
 };
 
 void *
@@ -24,9 +57,14 @@ bymark_init(struct userdata *u, size_t n)
 		goto fail_alloc;
 	}
 
-	data->nmarks = 0;
-	data->mw = NULL;
+	data->nrules = data->rules_alloc = 0;
+	data->rules = NULL;
+	data->ngroups = 0;
+	data->groups = NULL;
 	data->module_number = n;
+	modules[n].perpacket = 1;   /* mark can change from packet to packet */
+	modules[n].policy = 1;      /* drop and accept rules apply to fast path too */
+	modules[n].weight_batch = &bymark_weight_batch;
 
 	return data;
 
@@ -34,48 +72,196 @@ fail_alloc:
 	return NULL;
 }
 
+/* decimal number as before masks were supported, or hex with 0x prefix */
+static uint32_t
+bymark_strtou32(char *s, char **end)
+{
+	if ((s[0] == '0') && ((s[1] == 'x') || (s[1] == 'X'))) {
+		return strtoul(s, end, 16);
+	}
+
+	return strtoul(s, end, 10);
+}
+
+/* mark in form value[/mask], like in iptables */
 void
 bymark_conf(void *arg, char *param1, char *param2)
 {
 	struct bymark *data = arg;
-	int mark;
+	uint32_t value, mask;
 	double weight;
-	struct mark_weight *tmp_mw;
+	char *end;
 
-	mark = strtol(param1, NULL, 10);
-	if (errno) {
+	value = bymark_strtou32(param1, &end);
+	if (end == param1) {
 		fprintf(stderr, "Module %s: can't convert '%s' (mark) to integer \n",
 			modules[data->module_number].name,
 			param1);
-		mark = 0;
+		value = 0;
 	}
 
-	weight = strtod(param2, NULL);
-	if (errno) {
+	mask = UINT32_MAX;
+	if (*end == '/') {
+		char *mstart = end + 1;
+
+		mask = bymark_strtou32(mstart, &end);
+		if (end == mstart) {
+			fprintf(stderr, "Module %s: can't convert '%s' (mask) to integer \n",
+				modules[data->module_number].name,
+				mstart);
+			mask = UINT32_MAX;
+		}
+	}
+
+	weight = strtod(param2, &end);
+	if (!strcmp(param2, "accept")) {
+		/* whitelist, packets are accepted without queueing */
+		weight = INFINITY;
+	} else if (end == param2) {
 		fprintf(stderr, "Module %s: can't convert '%s' (mark weight) to double \n",
 			modules[data->module_number].name,
 			param2);
 	}
 
-	data->nmarks++;
-	tmp_mw = realloc(data->mw, sizeof(struct mark_weight) * data->nmarks);
-	if (!tmp_mw) {
-		fprintf(stderr, "Module %s: realloc() failed\n", modules[data->module_number].name);
-		free(data->mw);
-		data->mw = NULL;
-		data->nmarks = 0;
-		return; /* FIXME: return error? */
+	if (data->nrules == data->rules_alloc) {
+		struct mark_rule *tmp_rules;
+		size_t nalloc = data->rules_alloc ? data->rules_alloc * 2 : 64;
+
+		tmp_rules = realloc(data->rules, sizeof(struct mark_rule) * nalloc);
+		if (!tmp_rules) {
+			fprintf(stderr, "Module %s: realloc() failed\n", modules[data->module_number].name);
+			return; /* FIXME: return error? */
+		}
+		data->rules = tmp_rules;
+		data->rules_alloc = nalloc;
 	}
 
-	data->mw = tmp_mw;
-	data->mw[data->nmarks - 1].mark = mark;
-	data->mw[data->nmarks - 1].w = weight;
+	data->rules[data->nrules].value = value & mask;
+	data->rules[data->nrules].mask = mask;
+	data->rules[data->nrules].w = weight;
+	data->nrules++;
+}
+
+static uint32_t
+bymark_hash(uint32_t mark)
+{
+	return mark * 0x9e3779b1;
 }
 
+/* fill lookup table for group, rules with group mask are passed */
+static int
+bymark_group_fill(struct bymark *data, struct mark_group *g)
+{
+	size_t i, n = 0;
+	uint32_t min = UINT32_MAX, max = 0;
+
+	for (i=0; i<data->nrules; i++) {
+		if (data->rules[i].mask != g->mask) continue;
+
+		if (data->rules[i].value < min) min = data->rules[i].value;
+		if (data->rules[i].value > max) max = data->rules[i].value;
+		n++;
+	}
+
+	if ((((size_t)max - min + 1) <= n * 2 + 64) && (((size_t)max - min + 1) <= BYMARK_DIRECT_MAX)) {
+		/* dense range */
+		g->base = min;
+		g->nvals = (size_t)max - min + 1;
+		g->direct = malloc(g->nvals * sizeof(double));
+		if (!g->direct) {
+			return 0;
+		}
+		for (i=0; i<g->nvals; i++) {
+			g->direct[i] = NAN;
+		}
+	} else {
+		/* load factor <= 0.5 */
+		g->hsize = 1;
+		while (g->hsize < n * 2) {
+			g->hsize <<= 1;
+		}
+		g->hash = calloc(g->hsize, sizeof(struct mark_weight));
+		if (!g->hash) {
+			return 0;
+		}
+	}
+
+	for (i=0; i<data->nrules; i++) {
+		struct mark_rule *r = &data->rules[i];
+
+		if (r->mask != g->mask) continue;
+
+		if (g->direct) {
+			/* first rule wins */
+			if (isnan(g->direct[r->value - g->base])) {
+				g->direct[r->value - g->base] = r->w;
+			}
+		} else {
+			size_t h = bymark_hash(r->value) & (g->hsize - 1);
+
+			while (g->hash[h].used && (g->hash[h].mark != r->value)) {
+				h = (h + 1) & (g->hsize - 1);
+			}
+			if (!g->hash[h].used) {
+				g->hash[h].used = 1;
+				g->hash[h].mark = r->value;
+				g->hash[h].w = r->w;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static int
+bymark_group_cmp(const void *a, const void *b)
+{
+	const struct mark_group *ga = a, *gb = b;
+	int bitsa = __builtin_popcount(ga->mask);
+	int bitsb = __builtin_popcount(gb->mask);
+
+	return bitsb - bitsa;
+}
 
 int
 bymark_postconf(void *arg)
 {
+	struct bymark *data = arg;
+	size_t i, j;
+
+	/* one group for each distinct mask */
+	data->groups = calloc(data->nrules + 1, sizeof(struct mark_group));
+	if (!data->groups) {
+		fprintf(stderr, "Module %s: calloc() failed\n", modules[data->module_number].name);
+		return 0;
+	}
+
+	for (i=0; i<data->nrules; i++) {
+		for (j=0; j<data->ngroups; j++) {
+			if (data->groups[j].mask == data->rules[i].mask) break;
+		}
+		if (j == data->ngroups) {
+			data->groups[j].mask = data->rules[i].mask;
+			data->ngroups++;
+		}
+	}
+
+	/* longest mask wins */
+	qsort(data->groups, data->ngroups, sizeof(struct mark_group), &bymark_group_cmp);
+
+	for (j=0; j<data->ngroups; j++) {
+		if (!bymark_group_fill(data, &data->groups[j])) {
+			fprintf(stderr, "Module %s: can't allocate lookup table for mask 0x%x\n",
+				modules[data->module_number].name, data->groups[j].mask);
+			return 0;
+		}
+	}
+
+	/* rules are not needed anymore */
+	free(data->rules);
+	data->rules = NULL;
+	data->nrules = data->rules_alloc = 0;
+
 	return 1;
 }
 
@@ -83,26 +269,77 @@ void
 bymark_free(void *arg)
 {
 	struct bymark *data = arg;
+	size_t j;
 
-	free(data->mw);
+	for (j=0; j<data->ngroups; j++) {
+		free(data->groups[j].direct);
+		free(data->groups[j].hash);
+	}
+	free(data->groups);
+	free(data->rules);
 	free(data);
 }
 
+/* infinite weight is used for "accept" rules */
+static inline double
+bymark_result(double w, int *hints)
+{
+	if (isinf(w)) {
+		*hints |= HINT_ACCEPT;
+		return DBL_EPSILON;
+	}
+
+	return w;
+}
+
 double
-bymark_weight(void *arg, char *packet, int packetlen, int mark)
+bymark_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
 {
-	unsigned int i;
+	size_t i;
 	struct bymark *data = arg;
-	double m = DBL_EPSILON;
 
-	for (i=0; i<data->nmarks; i++) {
-		if (mark == data->mw[i].mark) {
-			m = data->mw[i].w;
-			break;
+	for (i=0; i<data->ngroups; i++) {
+		struct mark_group *g = &data->groups[i];
+		uint32_t v = (uint32_t)mark & g->mask;
+
+		if (g->direct) {
+			if ((v - g->base) < g->nvals) {
+				double w = g->direct[v - g->base];
+
+				if (!isnan(w)) {
+					return bymark_result(w, hints);
+				}
+			}
+		} else {
+			size_t h = bymark_hash(v) & (g->hsize - 1);
+
+			while (g->hash[h].used) {
+				if (g->hash[h].mark == v) {
+					return bymark_result(g->hash[h].w, hints);
+				}
+				h = (h + 1) & (g->hsize - 1);
+			}
 		}
 	}
 
-	return m;
+	return DBL_EPSILON;
 }
 
+/* packets of one batch often have the same mark, lookup is done once for them */
+void
+bymark_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w)
+{
+	size_t j;
+	int hints = 0;
+
+	for (j=0; j<n; j++) {
+		if ((j > 0) && (d[j].mark == d[j - 1].mark)) {
+			w[j] = w[j - 1];
+		} else {
+			hints = 0;
+			w[j] = bymark_weight(arg, d[j].packet, d[j].packetlen, d[j].mark, NULL, &hints);
+		}
+		d[j].hints |= hints;
+	}
+}
 
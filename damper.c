@@ -1,5 +1,5 @@
 /*
- * $ cc -Wall -pedantic damper.c modules.conf.c -o damper -lnetfilter_queue -pthread -lrt
+ * $ cc -Wall -pedantic damper.c flowtab.c top.c modules.conf.c -o damper -lnetfilter_queue -pthread -lrt
  */
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -7,21 +7,86 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <linux/netfilter.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
 #include "damper.h"
+#include "flowtab.h"
+#include "pipeline.h"
 #include "day2epoch.h"
+#include "statfile.h"
+#include "top.h"
 
 
 #define BILLION ((uint64_t)1000000000)
 
+/* ECN field in IP TOS */
+#define ECN_MASK    0x03
+#define ECN_NOT_ECT 0x00
+#define ECN_CE      0x03
+
 #define KEEP_STAT 31     /* keep statistics about one month by default */
+#define STAT_MS_MIN 10          /* shortest statistics record, milliseconds */
+#define STAT_FINE_WINDOW 600    /* seconds of records shorter than second */
+#define STAT_MAP_RETRY_MAX 600  /* longest delay between attempts to map day file */
 #define NFQ_DEFLEN 10000 /* internal queue length */
 
+#define OFFLOAD_PACKETS 1000        /* packets before flow weight is considered settled */
+#define OFFLOAD_DEV 0.1             /* maximum relative deviation of settled weight */
+#define OFFLOAD_AVG_PACKETS 1024.0  /* window of average packet weight */
+
+#define FASTPATH_BURST_MIN 3028     /* two full-sized ethernet frames */
+#define FASTPATH_BURST_DIV 100      /* default burst is 10ms of traffic */
+#define FASTPATH_SAMPLE 16          /* modules see every 16th fast packet */
+
+#define WORKER_RING 64              /* packets waiting for each worker */
+#define PKT_BATCH 32                /* packets weighed at once */
+#define RECV_BUFSIZE 0xffff
+
+/* parsed packet waiting for weight */
+struct pkt_desc
+{
+	int id;
+	uint32_t mark;
+	struct flow_key key;
+	int closed;                 /* conntrack reported connection closed */
+	int fast;                   /* tokens were taken, accept in place */
+
+	int size;
+	char *packet;
+};
+
+/* packet passed from capture thread to worker */
+struct work_item
+{
+	struct pkt_desc d;
+	unsigned char packet[DAMPER_MAX_PACKET_SIZE];
+};
+
+struct worker
+{
+	struct userdata *u;
+	pthread_t tid;
+
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty, nonfull;
+
+	struct work_item *ring;
+	size_t head, count;
+};
+
 /* indicate termination by signal */
 volatile sig_atomic_t damper_done = 0;
+/* config reload requested */
+volatile sig_atomic_t damper_reload = 0;
 
 /* signal handler */
 static void
@@ -30,6 +95,12 @@ on_term(int signum)
 	damper_done = 1;
 }
 
+static void
+on_hup(int signum)
+{
+	damper_reload = 1;
+}
+
 /* convert string with optional suffixes 'k', 'm' or 'g' (bits per second) to bytes per second */
 static uint64_t
 str2bps(const char *l)
@@ -72,21 +143,50 @@ str2bps(const char *l)
 	return res * k / 8;
 }
 
-FILE *
-fopen_or_create(const char *path)
+/* map day file of 'len' bytes, file is extended to full size at once,
+   so writes to mapping never allocate on disk */
+static unsigned char *
+stat_map(const char *path, size_t len)
 {
-	FILE *f;
+	int fd;
+	struct stat st;
+	void *p;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open file '%s'\n", path);
+		goto fail_open;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Can't stat file '%s'\n", path);
+		goto fail_size;
+	}
+	if ((size_t)st.st_size < len) {
+		/* filesystems without fallocate() get sparse file */
+		if ((posix_fallocate(fd, 0, len) != 0) && (ftruncate(fd, len) < 0)) {
+			fprintf(stderr, "Can't resize file '%s' to %lu bytes\n", path, (long)len);
+			goto fail_size;
+		}
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Can't mmap file '%s'\n", path);
+		goto fail_size;
+	}
+	close(fd);
+
+	return p;
 
-	f = fopen(path, "r+");
-	if (f) return f;
-	f = fopen(path, "w+");
-	if (f) return f;
-	fprintf(stderr, "Can't open file '%s'\n", path);
+fail_size:
+	close(fd);
+fail_open:
 	return NULL;
 }
 
 static void
-stat_remove_old(struct userdata *u)
+stat_remove_old(struct userdata *u, time_t now)
 {
 	DIR *dir;
 	struct dirent *de;
@@ -136,9 +236,9 @@ stat_remove_old(struct userdata *u)
 		/* calculate time_t for file */
 		t = day2epoch(day);
 
-		/* days between current timestamp and file */
-		days = (u->curr_timestamp - t) / (60 * 60 * 24);
-		if (days > u->keep_stat) {
+		/* days between current timestamp and file, rollups are kept longer */
+		days = (now - t) / STAT_DAY_SECONDS;
+		if (days > (strncmp(de->d_name, "damper-", 7) ? u->keep_stat : u->keep_rollup)) {
 			char path[PATH_MAX];
 
 			snprintf(path, PATH_MAX, "%s/%s", u->statdir, de->d_name);
@@ -150,450 +250,2314 @@ stat_remove_old(struct userdata *u)
 	closedir(dir);
 }
 
+/* seconds per record and file name prefix for each file of day */
+static const int stat_res[STAT_NRES] = {1, 60, 60 * 60};
+static const char *stat_prefix[STAT_NRES] = {"damper", "damper-m", "damper-h"};
+
+/* unmap files of day */
 static void
-stat_init(struct userdata *u)
+stat_day_unmap(struct stat_day *sd)
 {
-	if (u->statdir[0] == '\0') {
-		fprintf(stderr, "Directory for statistics is not set\n");
-		goto fail;
+	size_t i;
+
+	for (i=0; i<STAT_NRES; i++) {
+		if (sd->f[i].map) {
+			munmap(sd->f[i].map, sd->f[i].maplen);
+		}
+		free(sd->f[i].col);
+	}
+	if (sd->top) {
+		munmap(sd->top, sd->toplen);
 	}
+	memset(sd, 0, sizeof(struct stat_day));
+}
 
-	u->curr_timestamp = time(NULL);
-	u->old_timestamp = u->curr_timestamp;
+/* map file with layout h and series s, file written with other series is
+   moved aside */
+static int
+stat_file_open(const char *path, struct stat_file_header *h, struct stat_series *s, struct stat_mfile *mf)
+{
+	struct stat_file_header *fh;
+	size_t i, len;
+	int retry = 1;
 
-	u->cday = 0;
-	u->statf = NULL;
-	u->daystart = 0;
+	len = stat_file_layout(h, s);
 
-	memset(&u->stat_info, 0, sizeof(u->stat_info));
+again:
+	mf->map = stat_map(path, len);
+	if (!mf->map) {
+		goto fail_map;
+	}
+	mf->maplen = len;
+
+	fh = (struct stat_file_header *)mf->map;
+	if (fh->magic[0] == '\0') {
+		/* new file, magic goes last */
+		memcpy(mf->map + sizeof(*h), s, h->nseries * sizeof(struct stat_series));
+		memcpy(mf->map + sizeof(h->magic), (char *)h + sizeof(h->magic), sizeof(*h) - sizeof(h->magic));
+		__sync_synchronize();
+		memcpy(fh->magic, h->magic, sizeof(h->magic));
+	} else if (memcmp(fh, h, sizeof(*h))
+		|| memcmp(mf->map + sizeof(*h), s, h->nseries * sizeof(struct stat_series))) {
+
+		/* written with other modules or wchart setting */
+		char oldpath[PATH_MAX];
+
+		munmap(mf->map, mf->maplen);
+		mf->map = NULL;
+		if (!retry) {
+			goto fail_map;
+		}
+		snprintf(oldpath, PATH_MAX, "%s.old", path);
+		fprintf(stderr, "Statistics file '%s' has other series, moved to '%s'\n", path, oldpath);
+		if (rename(path, oldpath) < 0) {
+			goto fail_map;
+		}
+		retry = 0;
+		goto again;
+	}
 
-	if (u->wchart) {
-		size_t i;
+	mf->col = malloc(h->nseries * sizeof(uint64_t *));
+	if (!mf->col) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)(h->nseries * sizeof(uint64_t *)));
+		goto fail_col;
+	}
+	for (i=0; i<h->nseries; i++) {
+		mf->col[i] = (uint64_t *)(mf->map + s[i].offset);
+	}
 
-		for (i=0; modules[i].name; i++) {
-			modules[i].statf = NULL;
+	return 1;
+
+fail_col:
+	munmap(mf->map, mf->maplen);
+	mf->map = NULL;
+fail_map:
+	return 0;
+}
+
+/* map top talkers file of day */
+static int
+stat_top_open(struct userdata *u, const char *path, struct stat_day *sd)
+{
+	struct stat_top_header *th;
+	size_t len;
+	int retry = 1;
+
+	len = stat_top_offset(u->ntop, STAT_TOP_MINUTES, 0);
+
+again:
+	sd->top = stat_map(path, len);
+	if (!sd->top) {
+		return 0;
+	}
+	sd->toplen = len;
+
+	th = (struct stat_top_header *)sd->top;
+	if (th->magic[0] == '\0') {
+		th->ntop = u->ntop;
+		th->start = sd->start;
+		__sync_synchronize();
+		memcpy(th->magic, STAT_TOP_MAGIC, sizeof(th->magic));
+	} else if (memcmp(th->magic, STAT_TOP_MAGIC, sizeof(th->magic))
+		|| (th->ntop != u->ntop) || (th->start != sd->start)) {
+
+		char oldpath[PATH_MAX];
+
+		munmap(sd->top, sd->toplen);
+		sd->top = NULL;
+		if (!retry) {
+			return 0;
 		}
+		snprintf(oldpath, PATH_MAX, "%s.old", path);
+		fprintf(stderr, "Top talkers file '%s' has other layout, moved to '%s'\n", path, oldpath);
+		if (rename(path, oldpath) < 0) {
+			return 0;
+		}
+		retry = 0;
+		goto again;
 	}
 
-	return;
-fail:
-	u->stat = 0;
+	return 1;
 }
 
-static void
-stat_write(struct userdata *u)
+/* map files of day which contains second 't' */
+static int
+stat_day_map(struct userdata *u, time_t t, struct stat_day *sd)
 {
-	int day;
-	struct tm *t;
-	size_t i;
+	char path[PATH_MAX];
+	struct tm tm;
+	struct stat_file_header h;
+	struct stat_series *s;
+	size_t i, r, nmodules = 0, nseries;
+
+	memset(sd, 0, sizeof(struct stat_day));
 
 	/* get date in form DDMMYY */
-	t = gmtime(&u->curr_timestamp);
-	day = t->tm_mday * 100 * 100 + (t->tm_mon + 1) * 100 + (t->tm_year - 100);
+	gmtime_r(&t, &tm);
+	sd->day = tm.tm_mday * 100 * 100 + (tm.tm_mon + 1) * 100 + (tm.tm_year - 100);
 
-	if (day != u->cday) {
-		char path[PATH_MAX];
+	/* calculate time_t when day start */
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	sd->start = timegm(&tm);
 
-		/* day changed, close old file */
-		if (u->statf) {
-			fclose(u->statf);
-			u->statf = NULL;
-		}
-		/* files in modules */
-		if (u->wchart) {
-			for (i=0; modules[i].name; i++) {
-				if (modules[i].statf) {
-					fclose(modules[i].statf);
-					modules[i].statf = NULL;
-				}
-			}
-		}
+	if (u->wchart) {
+		for (nmodules=0; modules[nmodules].name; nmodules++);
+	}
 
-		/* and open new files */
-		snprintf(path, PATH_MAX, "%s/dstat.%06d.dat", u->statdir, day);
-		u->statf = fopen_or_create(path);
-		if (!u->statf) {
-			/* can't open file, stop collecting stats */
-			u->stat = 0;
-			return;
-		}
-		if (u->wchart) {
-			for (i=0; modules[i].name; i++) {
-				snprintf(path, PATH_MAX, "%s/%s.%06d.dat", u->statdir, modules[i].name, day);
-				modules[i].statf = fopen_or_create(path);
-				if (!modules[i].statf) {
-					u->wchart = 0;
-					return;
+	nseries = ((STAT_DAY_WEIGHTS > STAT_ROLLUP_WEIGHTS) ? STAT_DAY_WEIGHTS : STAT_ROLLUP_WEIGHTS) + nmodules;
+	s = malloc(nseries * sizeof(struct stat_series));
+	if (!s) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)(nseries * sizeof(struct stat_series)));
+		goto fail_series;
+	}
+
+	for (r=0; r<STAT_NRES; r++) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, STAT_FILE_MAGIC, sizeof(h.magic));
+		h.version = STAT_FILE_VERSION;
+		h.resolution = stat_res[r];
+		h.nrec = STAT_DAY_SECONDS / stat_res[r];
+		h.start = sd->start;
+
+		memset(s, 0, nseries * sizeof(struct stat_series));
+		if (r == 0) {
+			/* counters, queue and weight histograms for each second */
+			h.nseries = STAT_DAY_WEIGHTS + nmodules;
+			for (i=0; i<h.nseries; i++) {
+				if (i < STAT_DAY_QUEUE) {
+					strncpy(s[i].name, stat_counter_name(i), STAT_SERIES_NAME - 1);
+				} else if (i < STAT_DAY_SOJOURN) {
+					strncpy(s[i].name, stat_queue_name(i - STAT_DAY_QUEUE), STAT_SERIES_NAME - 1);
+				} else if (i < STAT_DAY_WEIGHTS) {
+					strncpy(s[i].name, stat_sojourn_name(i - STAT_DAY_SOJOURN), STAT_SERIES_NAME - 1);
+				} else {
+					strncpy(s[i].name, modules[i - STAT_DAY_WEIGHTS].name, STAT_SERIES_NAME - 1);
 				}
+				s[i].type = (i < STAT_DAY_WEIGHTS) ? STAT_SERIES_U64 : STAT_SERIES_WHIST;
+			}
+		} else {
+			/* rollup of counters */
+			h.nseries = STAT_ROLLUP_WEIGHTS + nmodules;
+			for (i=0; i<STAT_NCOUNTERS; i++) {
+				snprintf(s[i].name, STAT_SERIES_NAME, "%s", stat_counter_name(i));
+				snprintf(s[STAT_ROLLUP_MIN + i].name, STAT_SERIES_NAME, "%s.min", stat_counter_name(i));
+				snprintf(s[STAT_ROLLUP_MAX + i].name, STAT_SERIES_NAME, "%s.max", stat_counter_name(i));
+			}
+			snprintf(s[STAT_ROLLUP_SECONDS].name, STAT_SERIES_NAME, "seconds");
+			for (i=0; i<STAT_QUEUE_NSERIES; i++) {
+				snprintf(s[STAT_ROLLUP_QUEUE + i].name, STAT_SERIES_NAME, "%s", stat_queue_name(i));
+			}
+			snprintf(s[STAT_ROLLUP_SOJOURN_MAX].name, STAT_SERIES_NAME, "%s", stat_sojourn_name(STAT_SOJOURN_MAX));
+			for (i=0; i<STAT_HIST_NBUCKETS; i++) {
+				snprintf(s[STAT_ROLLUP_HIST + i].name, STAT_SERIES_NAME, "sojourn.%d", (int)i);
+			}
+			for (i=0; i<h.nseries; i++) {
+				s[i].type = STAT_SERIES_U64;
+			}
+			for (i=0; i<nmodules; i++) {
+				strncpy(s[STAT_ROLLUP_WEIGHTS + i].name, modules[i].name, STAT_SERIES_NAME - 1);
+				s[STAT_ROLLUP_WEIGHTS + i].type = STAT_SERIES_WHIST;
 			}
 		}
-		u->cday = day;
 
-		/* calculate time_t when day start */
-		t->tm_hour = t->tm_min = t->tm_sec = 0;
-		u->daystart = timegm(t);
+		snprintf(path, PATH_MAX, "%s/%s.%06d.dat", u->statdir, stat_prefix[r], sd->day);
+		if (!stat_file_open(path, &h, s, &sd->f[r])) {
+			goto fail_file;
+		}
+	}
 
-		/* delete old statistics files */
-		stat_remove_old(u);
+	if (u->ntop) {
+		snprintf(path, PATH_MAX, "%s/top.%06d.dat", u->statdir, sd->day);
+		if (!stat_top_open(u, path, sd)) {
+			goto fail_file;
+		}
 	}
 
-	fseek(u->statf, (u->curr_timestamp - u->daystart) * sizeof(struct stat_info), SEEK_SET);
-	fwrite(&u->stat_info, 1, sizeof(struct stat_info), u->statf); /* FIXME: check result? */
+	free(s);
+	return 1;
 
-	memset(&u->stat_info, 0, sizeof(u->stat_info));
+fail_file:
+	free(s);
+fail_series:
+	stat_day_unmap(sd);
+	return 0;
+}
 
-	/* write weights chart */
-	if (u->wchart) {
-		for (i=0; modules[i].name; i++) {
-			double avg;
+/* map ring of records shorter than second */
+static int
+stat_fine_open(struct userdata *u)
+{
+	char path[PATH_MAX];
+	struct stat_file_header h;
+	struct stat_series s[STAT_FINE_NSERIES];
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STAT_FINE_MAGIC, sizeof(h.magic));
+	h.version = STAT_FILE_VERSION;
+	h.resolution = u->stat_ms;
+	h.nrec = (uint64_t)u->fine_window * 1000 / u->stat_ms;
+	h.nseries = STAT_FINE_NSERIES;
+
+	memset(s, 0, sizeof(s));
+	for (i=0; i<STAT_FINE_NSERIES; i++) {
+		if (i == STAT_FINE_TIME) {
+			strncpy(s[i].name, "time", STAT_SERIES_NAME - 1);
+		} else if (i < STAT_FINE_QUEUE) {
+			strncpy(s[i].name, stat_counter_name(i - STAT_FINE_COUNTERS), STAT_SERIES_NAME - 1);
+		} else if (i < STAT_FINE_SOJOURN) {
+			strncpy(s[i].name, stat_queue_name(i - STAT_FINE_QUEUE), STAT_SERIES_NAME - 1);
+		} else {
+			strncpy(s[i].name, stat_sojourn_name(i - STAT_FINE_SOJOURN), STAT_SERIES_NAME - 1);
+		}
+		s[i].type = STAT_SERIES_U64;
+	}
 
-			avg = (modules[i].nw > DBL_EPSILON) ? (modules[i].stw / modules[i].nw) : 0.0f;
+	snprintf(path, PATH_MAX, "%s/%s", u->statdir, STAT_FINE_FILE);
+	return stat_file_open(path, &h, s, &u->sfine);
+}
 
-			fseek(modules[i].statf, (u->curr_timestamp - u->daystart) * sizeof(double), SEEK_SET);
-			fwrite(&avg, 1, sizeof(double), modules[i].statf);
+/* map live ring, it starts empty on each start */
+static int
+stat_live_open(struct userdata *u)
+{
+	char path[PATH_MAX];
+	struct stat_live_header *h;
 
-			modules[i].stw = modules[i].nw = 0.0f;
-		}
+	u->slivelen = sizeof(struct stat_live_header) + STAT_LIVE_NREC * sizeof(struct stat_live_record);
+	snprintf(path, PATH_MAX, "%s/%s", u->statdir, STAT_LIVE_FILE);
+	u->slive = stat_map(path, u->slivelen);
+	if (!u->slive) {
+		return 0;
 	}
 
-	u->old_timestamp = u->curr_timestamp;
+	/* readers retry while seq is odd */
+	h = (struct stat_live_header *)u->slive;
+	h->seq |= 1;
+	__sync_synchronize();
+	memset(u->slive + sizeof(*h), 0, u->slivelen - sizeof(*h));
+	memcpy(h->magic, STAT_LIVE_MAGIC, sizeof(h->magic));
+	h->nrec = STAT_LIVE_NREC;
+	h->count = 0;
+	__sync_synchronize();
+	h->seq++;
+
+	return 1;
+}
+
+static int
+stat_day_covers(struct stat_day *sd, time_t t)
+{
+	return sd->f[0].map && (t >= sd->start) && (t < sd->start + STAT_DAY_SECONDS);
 }
 
+/* maps files for next day and removes old ones, so stat thread never waits
+   for file system at day rollover */
 static void *
-stat_thread(void *arg)
+stat_day_thread(void *arg)
 {
 	struct userdata *u = arg;
-	struct timespec ts;
+	time_t retry = 0, delay = 1;
 
+	pthread_mutex_lock(&u->sday_lock);
 	while (!damper_done) {
-		/* sleep for nearest second */
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		ts.tv_sec++;
-		ts.tv_nsec = 0;
-		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		struct stat_day *cur = &u->sday[u->sday_cur];
+		struct stat_day *next = &u->sday[u->sday_cur ^ 1];
+		struct stat_day old, sd;
+		time_t want, now;
 
-		pthread_mutex_lock(&u->lock);
-		u->curr_timestamp++;
+		now = u->sday_now;
+		want = stat_day_covers(cur, now) ? (cur->start + STAT_DAY_SECONDS) : now;
 
-		if (u->stat) {
-			stat_write(u);
+		if (stat_day_covers(next, want) || (now < retry)) {
+			pthread_cond_wait(&u->sday_cond, &u->sday_lock);
+			continue;
 		}
 
-		pthread_mutex_unlock(&u->lock);
+		/* next slot is not used by stat thread, replace it */
+		old = *next;
+		memset(next, 0, sizeof(struct stat_day));
+		pthread_mutex_unlock(&u->sday_lock);
+
+		stat_day_unmap(&old);
+		if (stat_day_map(u, want, &sd)) {
+			/* keep days before current one, 'want' may be the next day */
+			stat_remove_old(u, now);
+		}
+
+		pthread_mutex_lock(&u->sday_lock);
+		if (sd.day) {
+			u->sday[u->sday_cur ^ 1] = sd;
+			retry = 0;
+			delay = 1;
+		} else {
+			/* try again on rollover request after delay, doubled on each failure */
+			retry = u->sday_now + delay;
+			delay = (delay * 2 < STAT_MAP_RETRY_MAX) ? (delay * 2) : STAT_MAP_RETRY_MAX;
+			pthread_cond_wait(&u->sday_cond, &u->sday_lock);
+		}
 	}
+	pthread_mutex_unlock(&u->sday_lock);
 
 	return NULL;
 }
 
-static int
-config_read(struct userdata *u, char *confname)
+static inline uint64_t
+stat_clock(void)
 {
-	FILE *f;
-	char line[LINE_MAX];
+	struct timespec ts;
 
-	f = fopen(confname, "r");
-	if (!f) {
-		fprintf(stderr, "Can't open file '%s'\n", confname);
-		goto fail_open;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
 
-	u->stat = 0;
-	u->statdir[0] = '\0';
+/* queue stayed at current level since last call, called with u->lock held
+   before queue is changed */
+static inline void
+stat_queue_time(struct userdata *u, uint64_t now)
+{
+	struct stat_queue *q = &u->stat_queue;
+	uint64_t ns = (now > q->last) ? (now - q->last) : 0;
 
-	u->keep_stat = 0;
-	u->nfqlen = 0;
+	q->packets_area += u->nqueued * ns;
+	q->octets_area += u->qoctets * ns;
+	q->time += ns;
+	q->last = now;
+}
 
-	u->wchart = 0;
+/* queue changed, called with u->lock held */
+static inline void
+stat_queue_level(struct userdata *u)
+{
+	struct stat_queue *q = &u->stat_queue;
 
-	while (fgets(line, sizeof(line), f)) {
-		char cmd[LINE_MAX], p1[LINE_MAX], p2[LINE_MAX];
-		int scanres;
+	if (u->nqueued < q->packets_min) {
+		q->packets_min = u->nqueued;
+	}
+	if (u->nqueued > q->packets_max) {
+		q->packets_max = u->nqueued;
+	}
+	if (u->qoctets < q->octets_min) {
+		q->octets_min = u->qoctets;
+	}
+	if (u->qoctets > q->octets_max) {
+		q->octets_max = u->qoctets;
+	}
+}
 
-		scanres = sscanf(line, "%s %s %s", cmd, p1, p2);
-		if ((cmd[0] == '#') || (scanres < 2)) {
-			continue;
-		}
-		if (!strcmp(cmd, "queue")) {
-			u->queue = atoi(p1);
-		} else if (!strcmp(cmd, "limit")) {
-			if (!strcmp(p1, "no")) {
-				u->limit = UINT64_MAX;
-			} else {
-				u->limit = str2bps(p1);
-			}
-		} else if (!strcmp(cmd, "stat")) {
-			if (!strcmp(p1, "yes")) {
-				u->stat = 1;
-			}
-		} else if (!strcmp(cmd, "keepstat")) {
-			u->keep_stat = atoi(p1);
-			if (u->keep_stat <= 0) {
-				fprintf(stderr, "Strange 'keepstat' value '%s', using %d instead", p1, KEEP_STAT);
-				u->keep_stat = KEEP_STAT;
-			}
-		} else if (!strcmp(cmd, "nfqlen")) {
-			u->nfqlen = atoi(p1);
-			if (u->nfqlen <= 0) {
-				fprintf(stderr, "Strange 'nfqlen' value '%s', using %d instead", p1, NFQ_DEFLEN);
-				u->nfqlen = NFQ_DEFLEN;
-			}
-		} else if (!strcmp(cmd, "wchart")) {
-			if (!strcmp(p1, "yes")) {
-				u->wchart = 1;
-			}
-		} else if (!strcmp(cmd, "statdir")) {
-			strncpy(u->statdir, p1, PATH_MAX);
-		} else if (!strcmp(cmd, "packets")) {
-			u->qlen = atoi(p1);
-		} else {
-			/* module parameters */
-			size_t i;
-			for (i=0; modules[i].name; i++) {
-				if (!strcmp(cmd, modules[i].name) && modules[i].conf) {
-					if (!strcmp(p1, "k")) {
-						/* multiplicator */
-						modules[i].k = atof(p2);
-					} else {
-						(modules[i].conf)(modules[i].mptr, p1, p2);
-					}
-					break;
-				}
-			}
-		}
+/* packet enqueued at 'qtime' is sent, called with u->lock held */
+static inline void
+stat_sojourn(struct userdata *u, uint64_t qtime, uint64_t now)
+{
+	struct stat_queue *q = &u->stat_queue;
+	uint64_t us = (now > qtime) ? (now - qtime) / 1000 : 0;
+
+	q->hist[stat_hist_bucket(us)]++;
+	if (us > q->sojourn_max) {
+		q->sojourn_max = us;
 	}
-	fclose(f);
-	return 1;
+}
 
-fail_open:
-	return 0;
+/* new second starts at current level, called with u->lock held */
+static void
+stat_queue_reset(struct userdata *u, uint64_t now)
+{
+	struct stat_queue *q = &u->stat_queue;
+
+	memset(q, 0, sizeof(struct stat_queue));
+	q->packets_min = q->packets_max = u->nqueued;
+	q->octets_min = q->octets_max = u->qoctets;
+	q->last = now;
 }
 
-static struct userdata *
-userdata_init(char *confname)
+static void
+stat_top_free(struct userdata *u)
 {
-	struct userdata *u;
 	size_t i;
 
-	u = malloc(sizeof(struct userdata));
-	if (!u) {
-		fprintf(stderr, "malloc(%lu) failed\n", (long)sizeof(struct userdata));
-		goto fail_create;
+	for (i=0; i<STAT_TOP_NKEYS; i++) {
+		top_destroy(u->top[i]);
+		top_destroy(u->top_spare[i]);
+		u->top[i] = u->top_spare[i] = NULL;
+	}
+}
+
+static void
+stat_init(struct userdata *u)
+{
+	if (u->statdir[0] == '\0') {
+		fprintf(stderr, "Directory for statistics is not set\n");
+		goto fail;
+	}
+
+	u->curr_timestamp = time(NULL);
+
+	memset(&u->stat_info, 0, sizeof(u->stat_info));
+
+	/* queue is empty yet */
+	memset(&u->stat_queue, 0, sizeof(u->stat_queue));
+	u->stat_queue.last = stat_clock();
+
+	memset(u->sday, 0, sizeof(u->sday));
+	u->sday_cur = 0;
+	u->sday_now = u->curr_timestamp;
+	pthread_mutex_init(&u->sday_lock, NULL);
+	pthread_cond_init(&u->sday_cond, NULL);
+
+	if (u->ntop) {
+		size_t i;
+
+		for (i=0; i<STAT_TOP_NKEYS; i++) {
+			int fkey = (i == STAT_TOP_HOSTS) ? FLOW_KEY_HOSTS : FLOW_KEY_5TUPLE;
+
+			u->top[i] = top_create(fkey, u->ntop * TOP_CAPACITY_MUL);
+			u->top_spare[i] = top_create(fkey, u->ntop * TOP_CAPACITY_MUL);
+			if (!u->top[i] || !u->top_spare[i]) {
+				goto fail_top;
+			}
+		}
+	}
+
+	u->wrollup = NULL;
+	memset(u->wrollup_rec, 0, sizeof(u->wrollup_rec));
+	if (u->wchart) {
+		size_t nmodules;
+
+		for (nmodules=0; modules[nmodules].name; nmodules++);
+		u->wrollup = calloc((STAT_NRES - 1) * nmodules * STAT_WHIST_NBUCKETS, sizeof(uint64_t));
+		if (!u->wrollup) {
+			fprintf(stderr, "Can't allocate memory for weight histograms\n");
+			goto fail_wrollup;
+		}
+	}
+
+	/* current day is mapped at start, next one in background */
+	if (!stat_day_map(u, u->curr_timestamp, &u->sday[0])) {
+		goto fail_map;
+	}
+	stat_remove_old(u, u->curr_timestamp);
+
+	memset(&u->sfine, 0, sizeof(u->sfine));
+	if ((u->stat_ms < 1000) && !stat_fine_open(u)) {
+		fprintf(stderr, "Statistics with %d ms resolution are disabled\n", u->stat_ms);
+		u->stat_ms = 1000;
+	}
+
+	if (!stat_live_open(u)) {
+		fprintf(stderr, "Live statistics are disabled\n");
+	}
+
+	return;
+
+fail_map:
+	free(u->wrollup);
+	u->wrollup = NULL;
+fail_wrollup:
+fail_top:
+	stat_top_free(u);
+	pthread_cond_destroy(&u->sday_cond);
+	pthread_mutex_destroy(&u->sday_lock);
+fail:
+	u->stat = 0;
+}
+
+static void
+stat_done(struct userdata *u)
+{
+	stat_day_unmap(&u->sday[0]);
+	stat_day_unmap(&u->sday[1]);
+	if (u->sfine.map) {
+		munmap(u->sfine.map, u->sfine.maplen);
+	}
+	free(u->sfine.col);
+	if (u->slive) {
+		munmap(u->slive, u->slivelen);
+	}
+	free(u->wrollup);
+	stat_top_free(u);
+	pthread_cond_destroy(&u->sday_cond);
+	pthread_mutex_destroy(&u->sday_lock);
+}
+
+/* account packet in top talkers, called with u->lock held */
+static inline void
+stat_top(struct userdata *u, void *packet, int size, int pass)
+{
+	struct flow_key key;
+	size_t i;
+
+	if (!u->ntop) {
+		return;
+	}
+
+	flow_key_parse(packet, size, &key);
+	for (i=0; i<STAT_TOP_NKEYS; i++) {
+		top_add(u->top[i], &key, size, pass);
+	}
+}
+
+/* write top talkers of minute with second 't' */
+static void
+stat_top_write(struct userdata *u, time_t t, struct top_entry **res)
+{
+	struct stat_day *sd;
+	size_t i, k, n;
+
+	pthread_mutex_lock(&u->sday_lock);
+	sd = &u->sday[u->sday_cur];
+	if (!stat_day_covers(sd, t)) {
+		sd = NULL;
+	}
+	pthread_mutex_unlock(&u->sday_lock);
+
+	for (k=0; k<STAT_TOP_NKEYS; k++) {
+		if (sd && sd->top) {
+			struct stat_top_record *rec;
+
+			rec = (struct stat_top_record *)(sd->top
+				+ stat_top_offset(u->ntop, (t - sd->start) / 60, k));
+
+			n = top_get(u->top_spare[k], res, u->ntop);
+			for (i=0; i<u->ntop; i++) {
+				if (i >= n) {
+					memset(&rec[i], 0, sizeof(struct stat_top_record));
+					continue;
+				}
+				rec[i].saddr = res[i]->key.saddr;
+				rec[i].daddr = res[i]->key.daddr;
+				rec[i].sport = res[i]->key.sport;
+				rec[i].dport = res[i]->key.dport;
+				rec[i].proto = res[i]->key.proto;
+				memset(rec[i].pad, 0, sizeof(rec[i].pad));
+				rec[i].octets_pass = res[i]->octets_pass;
+				rec[i].octets_drop = res[i]->octets_drop;
+				rec[i].packets_pass = res[i]->packets_pass;
+				rec[i].packets_drop = res[i]->packets_drop;
+				rec[i].err = res[i]->err;
+			}
+		}
+		top_clear(u->top_spare[k]);
+	}
+}
+
+/* add queue statistics of next interval */
+static void
+stat_queue_merge(struct stat_queue *dst, struct stat_queue *src)
+{
+	int b;
+
+	if (src->packets_min < dst->packets_min) {
+		dst->packets_min = src->packets_min;
+	}
+	if (src->packets_max > dst->packets_max) {
+		dst->packets_max = src->packets_max;
+	}
+	if (src->octets_min < dst->octets_min) {
+		dst->octets_min = src->octets_min;
+	}
+	if (src->octets_max > dst->octets_max) {
+		dst->octets_max = src->octets_max;
+	}
+	dst->packets_area += src->packets_area;
+	dst->octets_area += src->octets_area;
+	dst->time += src->time;
+	if (src->sojourn_max > dst->sojourn_max) {
+		dst->sojourn_max = src->sojourn_max;
+	}
+	for (b=0; b<STAT_HIST_NBUCKETS; b++) {
+		dst->hist[b] += src->hist[b];
+	}
+}
+
+/* values of counter, queue and sojourn series */
+static void
+stat_values(struct stat_info *si, struct stat_queue *sq, uint64_t *v, uint64_t *qv, uint64_t *sv)
+{
+	v[STAT_PACKETS_PASS] = si->packets_pass;
+	v[STAT_OCTETS_PASS]  = si->octets_pass;
+	v[STAT_PACKETS_DROP] = si->packets_drop;
+	v[STAT_OCTETS_DROP]  = si->octets_drop;
+
+	qv[STAT_QUEUE_PACKETS_MIN] = sq->packets_min;
+	qv[STAT_QUEUE_PACKETS_AVG] = sq->time ? (sq->packets_area / sq->time) : sq->packets_min;
+	qv[STAT_QUEUE_PACKETS_MAX] = sq->packets_max;
+	qv[STAT_QUEUE_OCTETS_MIN]  = sq->octets_min;
+	qv[STAT_QUEUE_OCTETS_AVG]  = sq->time ? (sq->octets_area / sq->time) : sq->octets_min;
+	qv[STAT_QUEUE_OCTETS_MAX]  = sq->octets_max;
+
+	sv[STAT_SOJOURN_P50] = stat_hist_percentile(sq->hist, 50);
+	sv[STAT_SOJOURN_P90] = stat_hist_percentile(sq->hist, 90);
+	sv[STAT_SOJOURN_P99] = stat_hist_percentile(sq->hist, 99);
+	sv[STAT_SOJOURN_MAX] = sq->sojourn_max;
+}
+
+/* write record ending at 'ms' (since epoch) to fine ring, called without u->lock */
+static void
+stat_fine_write(struct userdata *u, int64_t ms, struct stat_info *si, struct stat_queue *sq)
+{
+	uint64_t v[STAT_NCOUNTERS], qv[STAT_QUEUE_NSERIES], sv[STAT_SOJOURN_NSERIES];
+	uint64_t **col = u->sfine.col;
+	size_t i, nrec;
+	int c;
+
+	stat_values(si, sq, v, qv, sv);
+
+	nrec = (size_t)u->fine_window * 1000 / u->stat_ms;
+	i = (ms / u->stat_ms) % nrec;
+
+	/* reader checks time before and after values */
+	col[STAT_FINE_TIME][i] = 0;
+	__sync_synchronize();
+	for (c=0; c<STAT_NCOUNTERS; c++) {
+		col[STAT_FINE_COUNTERS + c][i] = v[c];
+	}
+	for (c=0; c<STAT_QUEUE_NSERIES; c++) {
+		col[STAT_FINE_QUEUE + c][i] = qv[c];
+	}
+	for (c=0; c<STAT_SOJOURN_NSERIES; c++) {
+		col[STAT_FINE_SOJOURN + c][i] = sv[c];
+	}
+	__sync_synchronize();
+	col[STAT_FINE_TIME][i] = ms;
+}
+
+/* publish tick in live ring */
+static void
+stat_live_write(struct userdata *u, int64_t ms, struct stat_info *si, struct stat_queue *sq)
+{
+	struct stat_live_header *h = (struct stat_live_header *)u->slive;
+	struct stat_live_record *rec;
+
+	rec = (struct stat_live_record *)(u->slive + sizeof(*h)) + h->count % STAT_LIVE_NREC;
+
+	h->seq++;
+	__sync_synchronize();
+	rec->time = ms;
+	rec->res = u->stat_ms;
+	stat_values(si, sq, rec->counters, rec->queue, rec->sojourn);
+	h->count++;
+	__sync_synchronize();
+	h->seq++;
+}
+
+/* add weight histograms of second 't' to rollup record, sums are kept in
+   memory, so rounding of file values doesn't accumulate */
+static void
+stat_whist_rollup(struct userdata *u, struct stat_day *sd, size_t r, time_t t, uint32_t *wh)
+{
+	size_t n, nmodules, ri = (t - sd->start) / stat_res[r];
+	uint64_t *acc;
+	int b, newrec;
+
+	for (nmodules=0; modules[nmodules].name; nmodules++);
+	acc = u->wrollup + (r - 1) * nmodules * STAT_WHIST_NBUCKETS;
+
+	newrec = (u->wrollup_rec[r - 1] != t / stat_res[r]);
+	u->wrollup_rec[r - 1] = t / stat_res[r];
+
+	for (n=0; n<nmodules; n++) {
+		uint8_t *h = (uint8_t *)sd->f[r].col[STAT_ROLLUP_WEIGHTS + n] + ri * STAT_WHIST_NBUCKETS;
+		uint64_t *a = acc + n * STAT_WHIST_NBUCKETS;
+
+		for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+			if (newrec) {
+				/* record could be started before restart */
+				a[b] = stat_whist_decode(h[b]);
+			}
+			a[b] += wh[n * STAT_WHIST_NBUCKETS + b];
+			h[b] = stat_whist_encode(a[b]);
+		}
+	}
+}
+
+/* write second 't' to day file, called without u->lock */
+static void
+stat_write(struct userdata *u, time_t t, struct stat_info *si, struct stat_queue *sq, uint32_t *wh)
+{
+	struct stat_day *sd;
+	uint64_t v[STAT_NCOUNTERS], qv[STAT_QUEUE_NSERIES], sv[STAT_SOJOURN_NSERIES];
+	size_t i, r;
+	int c;
+
+	pthread_mutex_lock(&u->sday_lock);
+	u->sday_now = t;
+	sd = &u->sday[u->sday_cur];
+	if (!stat_day_covers(sd, t)) {
+		/* day changed, next day should be mapped already */
+		if (stat_day_covers(&u->sday[u->sday_cur ^ 1], t)) {
+			u->sday_cur ^= 1;
+			sd = &u->sday[u->sday_cur];
+		} else {
+			/* not yet, this second is lost */
+			sd = NULL;
+		}
+		pthread_cond_signal(&u->sday_cond);
+	}
+	pthread_mutex_unlock(&u->sday_lock);
+
+	if (!sd) {
+		return;
+	}
+
+	stat_values(si, sq, v, qv, sv);
+
+	/* current slot is changed only by this thread, so it stays mapped */
+	i = t - sd->start;
+	for (c=0; c<STAT_NCOUNTERS; c++) {
+		sd->f[0].col[c][i] = v[c];
+	}
+	for (c=0; c<STAT_QUEUE_NSERIES; c++) {
+		sd->f[0].col[STAT_DAY_QUEUE + c][i] = qv[c];
+	}
+	for (c=0; c<STAT_SOJOURN_NSERIES; c++) {
+		sd->f[0].col[STAT_DAY_SOJOURN + c][i] = sv[c];
+	}
+
+	/* weight histograms */
+	if (u->wchart) {
+		size_t n;
+
+		for (n=0; modules[n].name; n++) {
+			uint8_t *h = (uint8_t *)sd->f[0].col[STAT_DAY_WEIGHTS + n] + i * STAT_WHIST_NBUCKETS;
+
+			for (c=0; c<STAT_WHIST_NBUCKETS; c++) {
+				h[c] = stat_whist_encode(wh[n * STAT_WHIST_NBUCKETS + c]);
+			}
+		}
+	}
+
+	/* minute and hour rollups, first second of record sets all values */
+	for (r=1; r<STAT_NRES; r++) {
+		uint64_t **col = sd->f[r].col;
+		size_t ri = i / stat_res[r];
+		int first = (col[STAT_ROLLUP_SECONDS][ri] == 0);
+
+		for (c=0; c<STAT_NCOUNTERS; c++) {
+			if (first) {
+				col[c][ri] = col[STAT_ROLLUP_MIN + c][ri] = col[STAT_ROLLUP_MAX + c][ri] = v[c];
+				continue;
+			}
+			col[c][ri] += v[c];
+			if (v[c] < col[STAT_ROLLUP_MIN + c][ri]) {
+				col[STAT_ROLLUP_MIN + c][ri] = v[c];
+			}
+			if (v[c] > col[STAT_ROLLUP_MAX + c][ri]) {
+				col[STAT_ROLLUP_MAX + c][ri] = v[c];
+			}
+		}
+
+		/* queue: minimum, sum of averages, maximum */
+		for (c=0; c<STAT_QUEUE_NSERIES; c++) {
+			uint64_t *q = &col[STAT_ROLLUP_QUEUE + c][ri];
+
+			if (first) {
+				*q = qv[c];
+			} else if ((c == STAT_QUEUE_PACKETS_AVG) || (c == STAT_QUEUE_OCTETS_AVG)) {
+				*q += qv[c];
+			} else if ((c == STAT_QUEUE_PACKETS_MIN) || (c == STAT_QUEUE_OCTETS_MIN)) {
+				if (qv[c] < *q) {
+					*q = qv[c];
+				}
+			} else if (qv[c] > *q) {
+				*q = qv[c];
+			}
+		}
+
+		if (first || (sq->sojourn_max > col[STAT_ROLLUP_SOJOURN_MAX][ri])) {
+			col[STAT_ROLLUP_SOJOURN_MAX][ri] = sq->sojourn_max;
+		}
+		for (c=0; c<STAT_HIST_NBUCKETS; c++) {
+			col[STAT_ROLLUP_HIST + c][ri] = (first ? 0 : col[STAT_ROLLUP_HIST + c][ri]) + sq->hist[c];
+		}
+		if (u->wchart) {
+			stat_whist_rollup(u, sd, r, t, wh);
+		}
+
+		col[STAT_ROLLUP_SECONDS][ri]++;
+	}
+}
+
+static void *
+stat_thread(void *arg)
+{
+	struct userdata *u = arg;
+	struct timespec ts;
+	struct stat_info si, tsi;
+	struct stat_queue sq, tsq;
+	struct top_entry **tres;
+	uint32_t *wh;
+	size_t i, nmodules;
+	time_t t;
+	int64_t ms;
+	int b, topflush, second, first = 1;
+	long tick_ns = (u->stat ? u->stat_ms : 1000) * 1000000L;
+
+	for (nmodules=0; modules[nmodules].name; nmodules++);
+	wh = calloc(nmodules * STAT_WHIST_NBUCKETS, sizeof(uint32_t));
+	tres = calloc(u->ntop + 1, sizeof(struct top_entry *));
+	if (!wh || !tres) {
+		fprintf(stderr, "Can't allocate memory for stat thread\n");
+		free(wh);
+		free(tres);
+		return NULL;
+	}
+
+	while (!damper_done) {
+		/* sleep for nearest tick, ticks are aligned to second */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec = (ts.tv_nsec / tick_ns + 1) * tick_ns;
+		if (ts.tv_nsec >= (long)BILLION) {
+			ts.tv_sec++;
+			ts.tv_nsec = 0;
+		}
+		second = (ts.tv_nsec == 0);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		/* only take counters under lock, files are written after */
+		pthread_mutex_lock(&u->lock);
+		t = second ? ++u->curr_timestamp : u->curr_timestamp;
+
+		tsi = u->stat_info;
+		memset(&u->stat_info, 0, sizeof(u->stat_info));
+
+		if (u->stat) {
+			uint64_t now = stat_clock();
+
+			stat_queue_time(u, now);
+			tsq = u->stat_queue;
+			stat_queue_reset(u, now);
+		}
+
+		/* minute is over, new sketches for next one */
+		topflush = second && u->stat && u->ntop && ((t % 60) == 0);
+		if (topflush) {
+			for (i=0; i<STAT_TOP_NKEYS; i++) {
+				struct top_sketch *tmp = u->top[i];
+
+				u->top[i] = u->top_spare[i];
+				u->top_spare[i] = tmp;
+			}
+		}
+		pthread_mutex_unlock(&u->lock);
+
+		/* weight histograms are updated without lock */
+		if (second && u->wchart) {
+			for (i=0; i<nmodules; i++) {
+				for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+					wh[i * STAT_WHIST_NBUCKETS + b] = __sync_lock_test_and_set(&modules[i].whist[b], 0);
+				}
+			}
+		}
+
+		if (topflush) {
+			/* before stat_write(), which may switch to next day */
+			stat_top_write(u, t - 1, tres);
+		}
+
+		if (!u->stat) {
+			continue;
+		}
+
+		/* tick ending at T is summed to second record ceil(T), fine and
+		   live records have the same offset in that second */
+		ms = (int64_t)t * 1000 + ts.tv_nsec / 1000000 + 1000 - u->stat_ms;
+		if (u->stat_ms < 1000) {
+			stat_fine_write(u, ms, &tsi, &tsq);
+		}
+		if (u->slive) {
+			stat_live_write(u, ms, &tsi, &tsq);
+		}
+
+		/* ticks of second are summed */
+		if (first) {
+			si = tsi;
+			sq = tsq;
+			first = 0;
+		} else {
+			si.packets_pass += tsi.packets_pass;
+			si.octets_pass  += tsi.octets_pass;
+			si.packets_drop += tsi.packets_drop;
+			si.octets_drop  += tsi.octets_drop;
+			stat_queue_merge(&sq, &tsq);
+		}
+
+		if (second) {
+			stat_write(u, t, &si, &sq, wh);
+			first = 1;
+		}
+	}
+
+	free(tres);
+	free(wh);
+
+	return NULL;
+}
+
+static int
+config_read(struct userdata *u, char *confname, int reload)
+{
+	FILE *f;
+	char line[LINE_MAX];
+
+	f = fopen(confname, "r");
+	if (!f) {
+		fprintf(stderr, "Can't open file '%s'\n", confname);
+		goto fail_open;
+	}
+
+	if (reload) {
+		size_t i;
+
+		/* 'k' removed from config returns to default */
+		for (i=0; modules[i].name; i++) {
+			modules[i].k = 1.0f;
+		}
+	}
+
+	u->stat = 0;
+	u->statdir[0] = '\0';
+
+	u->keep_stat = 0;
+	u->keep_rollup = 0;
+	u->ntop = 0;
+	u->stat_ms = 1000;
+	u->fine_window = STAT_FINE_WINDOW;
+	u->nfqlen = 0;
+
+	u->wchart = 0;
+	u->conntrack = 0;
+	u->ackthin = 0;
+	u->ecn = 0;
+	u->bypass_octets = 0;
+	u->nflows = 0;
+
+	u->offload_bulk = u->offload_unshaped = u->offload_mask = 0;
+	u->offload_packets = OFFLOAD_PACKETS;
+	u->wavg = 0.0f;
+
+	u->nworkers = 0;
+	u->workers = NULL;
+
+	u->wcache_packets = u->wcache_ms = 0;
+	u->snapshot[0] = '\0';
+
+	u->fastpath = 0;
+	u->fp_burst = 0;
+	u->fp_sample = FASTPATH_SAMPLE;
+
+	while (fgets(line, sizeof(line), f)) {
+		char cmd[LINE_MAX], p1[LINE_MAX], p2[LINE_MAX];
+		int scanres;
+
+		scanres = sscanf(line, "%s %s %s", cmd, p1, p2);
+		if ((cmd[0] == '#') || (scanres < 2)) {
+			continue;
+		}
+		if (!strcmp(cmd, "queue")) {
+			u->queue = atoi(p1);
+		} else if (!strcmp(cmd, "limit")) {
+			if (!strcmp(p1, "no")) {
+				u->limit = UINT64_MAX;
+			} else {
+				u->limit = str2bps(p1);
+			}
+		} else if (!strcmp(cmd, "stat")) {
+			if (!strcmp(p1, "yes")) {
+				u->stat = 1;
+			}
+		} else if (!strcmp(cmd, "top")) {
+			u->ntop = atoi(p1);
+			if (u->ntop < 0) {
+				fprintf(stderr, "Strange 'top' value '%s', top talkers are disabled\n", p1);
+				u->ntop = 0;
+			}
+		} else if (!strcmp(cmd, "statres")) {
+			u->stat_ms = atoi(p1);
+			if ((u->stat_ms < STAT_MS_MIN) || (u->stat_ms > 1000) || (1000 % u->stat_ms)) {
+				fprintf(stderr, "Strange 'statres' value '%s', must divide 1000 ms, using 1000\n", p1);
+				u->stat_ms = 1000;
+			}
+		} else if (!strcmp(cmd, "finewindow")) {
+			u->fine_window = atoi(p1);
+			if (u->fine_window <= 0) {
+				fprintf(stderr, "Strange 'finewindow' value '%s', using %d instead\n", p1, STAT_FINE_WINDOW);
+				u->fine_window = STAT_FINE_WINDOW;
+			}
+		} else if (!strcmp(cmd, "keeprollup")) {
+			u->keep_rollup = atoi(p1);
+			if (u->keep_rollup < 0) {
+				fprintf(stderr, "Strange 'keeprollup' value '%s', rollups are kept as 'keepstat'\n", p1);
+				u->keep_rollup = 0;
+			}
+		} else if (!strcmp(cmd, "keepstat")) {
+			u->keep_stat = atoi(p1);
+			if (u->keep_stat <= 0) {
+				fprintf(stderr, "Strange 'keepstat' value '%s', using %d instead", p1, KEEP_STAT);
+				u->keep_stat = KEEP_STAT;
+			}
+		} else if (!strcmp(cmd, "nfqlen")) {
+			u->nfqlen = atoi(p1);
+			if (u->nfqlen <= 0) {
+				fprintf(stderr, "Strange 'nfqlen' value '%s', using %d instead", p1, NFQ_DEFLEN);
+				u->nfqlen = NFQ_DEFLEN;
+			}
+		} else if (!strcmp(cmd, "wchart")) {
+			if (!strcmp(p1, "yes")) {
+				u->wchart = 1;
+			}
+		} else if (!strcmp(cmd, "ecn")) {
+			if (!strcmp(p1, "yes")) {
+				u->ecn = 1;
+			}
+		} else if (!strcmp(cmd, "ackthin")) {
+			if (!strcmp(p1, "yes")) {
+				u->ackthin = 1;
+			}
+		} else if (!strcmp(cmd, "conntrack")) {
+			if (!strcmp(p1, "yes")) {
+				u->conntrack = 1;
+			}
+		} else if (!strcmp(cmd, "offload") && (scanres == 3)) {
+			uint32_t v = strtoul(p2, NULL, 0);
+
+			if (!strcmp(p1, "bulk")) {
+				u->offload_bulk = v;
+			} else if (!strcmp(p1, "unshaped")) {
+				u->offload_unshaped = v;
+			} else if (!strcmp(p1, "mask")) {
+				u->offload_mask = v;
+			} else if (!strcmp(p1, "packets")) {
+				u->offload_packets = v;
+			} else {
+				fprintf(stderr, "Unknown 'offload' parameter '%s'\n", p1);
+			}
+		} else if (!strcmp(cmd, "wcache") && (scanres == 3)) {
+			if (!strcmp(p1, "packets")) {
+				u->wcache_packets = strtoul(p2, NULL, 0);
+			} else if (!strcmp(p1, "ms")) {
+				u->wcache_ms = strtoul(p2, NULL, 0);
+			} else {
+				fprintf(stderr, "Unknown 'wcache' parameter '%s'\n", p1);
+			}
+		} else if (!strcmp(cmd, "workers")) {
+			int n = atoi(p1);
+
+			if (n < 0) {
+				fprintf(stderr, "Strange 'workers' value '%s', using 0 instead", p1);
+				n = 0;
+			}
+			u->nworkers = n;
+		} else if (!strcmp(cmd, "fastpath")) {
+			if (!strcmp(p1, "yes")) {
+				u->fastpath = 1;
+			} else if (!strcmp(p1, "burst") && (scanres == 3)) {
+				u->fp_burst = strtoull(p2, NULL, 0);
+			} else if (!strcmp(p1, "sample") && (scanres == 3)) {
+				u->fp_sample = strtoul(p2, NULL, 0);
+				if (u->fp_sample == 0) {
+					fprintf(stderr, "Strange 'fastpath sample' value '%s', using %d instead\n", p2, FASTPATH_SAMPLE);
+					u->fp_sample = FASTPATH_SAMPLE;
+				}
+			}
+		} else if (!strcmp(cmd, "snapshot")) {
+			strncpy(u->snapshot, p1, PATH_MAX - 1);
+			u->snapshot[PATH_MAX - 1] = '\0';
+		} else if (!strcmp(cmd, "statdir")) {
+			strncpy(u->statdir, p1, PATH_MAX);
+		} else if (!strcmp(cmd, "packets")) {
+			u->qlen = atoi(p1);
+		} else if (!strcmp(cmd, "flows")) {
+			char *end;
+			long nflows = strtol(p1, &end, 10);
+
+			if ((end == p1) || (nflows <= 0) || ((unsigned long)nflows > FLOWS_MAX)) {
+				fprintf(stderr, "Strange 'flows' value '%s', using %d instead\n", p1, FLOWS_DEF);
+				nflows = FLOWS_DEF;
+			}
+			u->nflows = nflows;
+		} else {
+			/* module parameters */
+			size_t i;
+			for (i=0; modules[i].name; i++) {
+				if (!strcmp(cmd, modules[i].name) && modules[i].conf) {
+					if (!strcmp(p1, "k")) {
+						/* multiplicator */
+						modules[i].k = atof(p2);
+					} else if (!reload) {
+						/* module tables are built once, in postconf */
+						(modules[i].conf)(modules[i].mptr, p1, p2);
+					}
+					break;
+				}
+			}
+		}
+	}
+	fclose(f);
+	return 1;
+
+fail_open:
+	return 0;
+}
+
+static int
+workers_init(struct userdata *u)
+{
+	size_t i;
+
+	if (u->nworkers == 0) {
+		return 1;
+	}
+
+	u->workers = calloc(u->nworkers, sizeof(struct worker));
+	if (!u->workers) {
+		fprintf(stderr, "calloc(%lu) failed\n", (long)(u->nworkers * sizeof(struct worker)));
+		goto fail_workers;
+	}
+
+	for (i=0; i<u->nworkers; i++) {
+		struct worker *w = &u->workers[i];
+
+		w->u = u;
+		w->ring = malloc(WORKER_RING * sizeof(struct work_item));
+		if (!w->ring) {
+			fprintf(stderr, "malloc(%lu) failed\n", (long)(WORKER_RING * sizeof(struct work_item)));
+			goto fail_ring;
+		}
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->nonempty, NULL);
+		pthread_cond_init(&w->nonfull, NULL);
+	}
+
+	return 1;
+
+fail_ring:
+	while (i--) {
+		free(u->workers[i].ring);
+	}
+	free(u->workers);
+	u->workers = NULL;
+fail_workers:
+	return 0;
+}
+
+/* values which depend on other parameters */
+static void
+config_derive(struct userdata *u)
+{
+	/* by default damper owns only offload marks */
+	if (u->offload_mask == 0) {
+		u->offload_mask = u->offload_bulk | u->offload_unshaped;
+	}
+
+	if (u->fastpath) {
+		if (u->fp_burst == 0) {
+			u->fp_burst = ((u->limit == UINT64_MAX) ? 0 : u->limit) / FASTPATH_BURST_DIV;
+		}
+		if (u->fp_burst < FASTPATH_BURST_MIN) {
+			u->fp_burst = FASTPATH_BURST_MIN;
+		}
+	}
+}
+
+/* re-read config on SIGHUP. NFQUEUE binding, queue and tables are kept,
+   so only parameters which don't change them are applied */
+static void
+config_reload(struct userdata *u, char *confname)
+{
+	struct userdata *n;
+
+	n = calloc(1, sizeof(struct userdata));
+	if (!n) {
+		fprintf(stderr, "calloc(%lu) failed\n", (long)sizeof(struct userdata));
+		return;
+	}
+
+	if (!config_read(n, confname, 1)) {
+		free(n);
+		return;
+	}
+	config_derive(n);
+
+	if ((n->queue != u->queue) || (n->qlen != u->qlen) || (n->nworkers != u->nworkers)
+		|| (n->conntrack != u->conntrack) || (n->stat != u->stat) || (n->wchart != u->wchart)
+		|| (n->nflows && (n->nflows != u->nflows))) {
+
+		fprintf(stderr, "Config reload: queue, packets, flows, workers, conntrack, stat and wchart "
+			"are changed on restart only\n");
+	}
+
+	pthread_mutex_lock(&u->lock);
+
+	if (n->limit == 0) {
+		fprintf(stderr, "Something is wrong with limit, all traffic will be blocked\n");
+	}
+	u->limit = n->limit;
+	u->ecn = n->ecn;
+	u->ackthin = n->ackthin;
+
+	if (u->coreft || !(n->offload_bulk || n->wcache_packets || n->wcache_ms)) {
+		u->offload_bulk = n->offload_bulk;
+		u->wcache_packets = n->wcache_packets;
+		u->wcache_ms = n->wcache_ms;
+	} else {
+		fprintf(stderr, "Config reload: 'offload bulk' and 'wcache' need flow table, restart damper\n");
+	}
+	u->offload_unshaped = n->offload_unshaped;
+	u->offload_mask = n->offload_mask;
+	u->offload_packets = n->offload_packets;
+
+	if (n->fastpath && !u->fastpath) {
+		u->fp_tokens = n->fp_burst;
+		u->fp_count = 0;
+		clock_gettime(CLOCK_MONOTONIC, &u->fp_time);
+	}
+	u->fastpath = n->fastpath;
+	u->fp_burst = n->fp_burst;
+	u->fp_sample = n->fp_sample;
+
+	pthread_mutex_unlock(&u->lock);
+
+	fprintf(stderr, "Config '%s' reloaded\n", confname);
+	free(n);
+}
+
+/* accept packets left in queue on exit */
+static void
+queue_flush(struct userdata *u)
+{
+	size_t i;
+
+	pthread_mutex_lock(&u->lock);
+	for (i=0; i<u->qlen; i++) {
+		if (u->prioarray[i] != DBL_MIN) {
+			nfq_set_verdict2(u->qh, u->packets[i].id, NF_ACCEPT, u->packets[i].mark,
+				u->packets[i].size, u->packets[i].packet);
+			u->prioarray[i] = DBL_MIN;
+		}
+	}
+	u->nqueued = 0;
+	u->qoctets = 0;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static struct userdata *
+userdata_init(char *confname)
+{
+	struct userdata *u;
+	size_t i;
+
+	u = malloc(sizeof(struct userdata));
+	if (!u) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)sizeof(struct userdata));
+		goto fail_create;
+	}
+
+	/* init modules */
+	for (i=0; modules[i].name; i++) {
+		if (modules[i].init) {
+			/* default multiplicator */
+			modules[i].k = 1.0f;
+
+			modules[i].mptr = (modules[i].init)(u, i);
+		} else {
+			modules[i].mptr = NULL;
+		}
+	}
+
+	if (!config_read(u, confname, 0)) {
+		goto fail_conf;
+	}
+
+	if (u->limit == 0) {
+		fprintf(stderr, "Something is wrong with limit, all traffic will be blocked\n");
+	}
+
+	if (u->nfqlen == 0) {
+		u->nfqlen = NFQ_DEFLEN;
+	}
+
+	config_derive(u);
+
+	if (u->fastpath) {
+		u->fp_tokens = u->fp_burst;
+		u->fp_count = 0;
+		clock_gettime(CLOCK_MONOTONIC, &u->fp_time);
+	}
+
+	/* setup statistics */
+	if (u->stat) {
+		if (u->keep_stat == 0) {
+			fprintf(stderr, "'keepstat' not set, statistics will be kept for %d days\n", KEEP_STAT);
+			u->keep_stat = KEEP_STAT;
+		}
+		if (u->keep_rollup < u->keep_stat) {
+			u->keep_rollup = u->keep_stat;
+		}
+		stat_init(u);
+	}
+
+	/* reserve memory for packets in queue */
+	u->packets = malloc(u->qlen * sizeof(struct mpacket));
+	if (!u->packets) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)u->qlen * sizeof(struct mpacket));
+		goto fail_packets;
+	}
+
+	/* create priority array - simplified implementation of priority queue */
+	u->prioarray = malloc(u->qlen * sizeof(double));
+	if (!u->prioarray) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)u->qlen * sizeof(double));
+		goto fail_prio_array;
+	}
+	/* fill priority array with minimal possible values */
+	for (i=0; i<u->qlen; i++) {
+		u->prioarray[i] = DBL_MIN;
+	}
+	u->nqueued = 0;
+	u->inflight = 0;
+	u->qoctets = 0;
+
+	/* packets received at once and waiting for weight */
+	u->pending = malloc(PKT_BATCH * sizeof(struct pkt_desc));
+	if (!u->pending) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)(PKT_BATCH * sizeof(struct pkt_desc)));
+		goto fail_pending;
+	}
+	u->npending = 0;
+
+	/* init mutex */
+	pthread_mutex_init(&u->lock, NULL);
+
+	/* configuration done, notify modules */
+	for (i=0; modules[i].name; i++) {
+		if (modules[i].postconf) {
+			int mres;
+
+			mres = (modules[i].postconf)(modules[i].mptr);
+			if (mres == MODULE_UNUSED) {
+				fprintf(stderr, "Module '%s': not configured, disabled\n", modules[i].name);
+				modules[i].enabled = 0;
+			} else if (!mres) {
+				/* disable module */
+				fprintf(stderr, "Module '%s': initialization failed, disabling\n", modules[i].name);
+				modules[i].enabled = 0;
+			} else {
+				modules[i].enabled = 1;
+			}
+		}
+	}
+
+	u->static_pipeline = 0;
+#ifdef DAMPER_STATIC_PIPELINE
+	if (modules_static_check()) {
+		u->static_pipeline = 1;
+		modules_static_disable();
+	} else {
+		fprintf(stderr, "Static weight pipeline doesn't match modules[], using generic one\n");
+	}
+#endif
+
+	/* allocate per-flow state for enabled modules */
+	if (!flowtab_init(u)) {
+		goto fail_flowtab;
+	}
+
+	if (!workers_init(u)) {
+		goto fail_workers;
+	}
+
+	/* flows from previous run */
+	if (u->snapshot[0]) {
+		flowtab_load(u, u->snapshot);
+	}
+
+	return u;
+
+fail_workers:
+	flowtab_destroy(u);
+fail_flowtab:
+	free(u->pending);
+fail_pending:
+	free(u->prioarray);
+fail_prio_array:
+	free(u->packets);
+fail_packets:
+fail_conf:
+	free(u);
+fail_create:
+
+	return NULL;
+}
+
+static void
+userdata_destroy(struct userdata *u)
+{
+	size_t i;
+
+	/* save flows for next run */
+	if (u->snapshot[0]) {
+		flowtab_save(u, u->snapshot);
+	}
+
+	for (i=0; modules[i].name; i++) {
+		if (modules[i].done) {
+			(modules[i].done)(modules[i].mptr);
+		}
+	}
+
+	for (i=0; i<u->nworkers; i++) {
+		free(u->workers[i].ring);
+	}
+	free(u->workers);
+
+	flowtab_destroy(u);
+	pthread_mutex_destroy(&u->lock);
+
+	if (u->stat) {
+		stat_done(u);
+	}
+	free(u->pending);
+	free(u->prioarray);
+	free(u->packets);
+	free(u);
+}
+
+/* refill token bucket, called with u->lock held */
+static void
+fastpath_refill(struct userdata *u)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - u->fp_time.tv_sec) + (now.tv_nsec - u->fp_time.tv_nsec) / (double)BILLION;
+	u->fp_time = now;
+
+	u->fp_tokens += elapsed * u->limit;
+	if (u->fp_tokens > u->fp_burst) {
+		u->fp_tokens = u->fp_burst;
+	}
+}
+
+/* octets sent by sender thread or out of turn use tokens too, called with u->lock held */
+static void
+fastpath_use(struct userdata *u, uint64_t octets)
+{
+	fastpath_refill(u);
+	u->fp_tokens -= octets;
+}
+
+/* packet can be accepted in place: queue is empty, no packet is waiting
+   for weight (it could be of the same flow) and there are tokens for it.
+   called with u->lock held */
+static int
+fastpath_take(struct userdata *u, int size)
+{
+	if ((u->nqueued > 0) || (u->inflight > 0)) {
+		return 0;
+	}
+
+	fastpath_refill(u);
+	if (u->fp_tokens < size) {
+		return 0;
+	}
+	u->fp_tokens -= size;
+
+	return 1;
+}
+
+/* fast packet is not weighed, but drop and accept rules of policy modules
+   still apply. returns negative weight if packet must be dropped */
+static double
+fastpath_policy(struct userdata *u, char *p, int plen, uint32_t mark)
+{
+	size_t i;
+
+	for (i=0; modules[i].name; i++) {
+		double w;
+		int hints = 0;
+
+		if (!modules[i].enabled || !modules[i].policy) {
+			continue;
+		}
+		w = modules[i].weight(modules[i].mptr, p, plen, mark, NULL, &hints);
+		if (w < 0.0) {
+			return w;
+		}
+		if (hints & (HINT_ACCEPT | HINT_FINAL)) {
+			break;
+		}
+	}
+
+	return 0.0;
+}
+
+static void *
+sender_thread(void *arg)
+{
+
+	struct userdata *u = arg;
+	int vres;
+	size_t i, idx = 0;
+	double max = DBL_MIN;
+	uint64_t limit;
+	uint64_t sleep_ns;
+
+	for (;;) {
+		struct timespec ts;
+
+		pthread_mutex_lock(&u->lock);
+		limit = u->limit;
+
+		if ((limit == 0) || (limit == UINT64_MAX)) {
+			/* change limit to kbyte/sec, so will sleep about 0.1 sec */
+			limit = 1000;
+		}
+
+		/* search for packet with maximum priority */
+		max = DBL_MIN;
+		for (i=0; i<u->qlen; i++) {
+			if (max < u->prioarray[i]) {
+				max = u->prioarray[i];
+				idx = i;
+			}
+		}
+
+		if (max != DBL_MIN) {
+			uint64_t now = 0;
+
+			if (u->stat) {
+				now = stat_clock();
+				stat_queue_time(u, now);
+			}
+
+			/* accept (send) packet */
+			vres = nfq_set_verdict2(u->qh, u->packets[idx].id,
+				NF_ACCEPT, u->packets[idx].mark, u->packets[idx].size, u->packets[idx].packet);
+
+			if (vres < 0) {
+				fprintf(stderr, "nfq_set_verdict2() failed, %s\n", strerror(errno));
+			}
+
+			/* mark packet buffer as empty */
+			u->prioarray[idx] = DBL_MIN;
+			u->nqueued--;
+			u->qoctets -= u->packets[idx].size;
+
+			/* update statistics */
+			if (u->stat) {
+				u->stat_info.packets_pass += 1;
+				u->stat_info.octets_pass+= u->packets[idx].size;
+				stat_top(u, u->packets[idx].packet, u->packets[idx].size, 1);
+				stat_sojourn(u, u->packets[idx].qtime, now);
+				stat_queue_level(u);
+			}
+			sleep_ns = ((u->packets[idx].size + u->bypass_octets) * BILLION) / limit;
+		} else {
+			/* no data to send, so just sleep for time required to transfer 100 bytes */
+			sleep_ns = ((100 + u->bypass_octets) * BILLION) / limit;
+		}
+		/* packets sent out of turn are accounted here */
+		if (u->fastpath) {
+			fastpath_use(u, (max != DBL_MIN ? u->packets[idx].size : 0) + u->bypass_octets);
+		}
+		u->bypass_octets = 0;
+
+		if (sleep_ns > BILLION) {
+			ts.tv_sec = sleep_ns / BILLION;
+			ts.tv_nsec = sleep_ns % BILLION;
+		} else {
+			ts.tv_sec = 0;
+			ts.tv_nsec = sleep_ns;
+		}
+
+		pthread_mutex_unlock(&u->lock);
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+
+	return NULL;
+}
+
+
+/* set CE codepoint in ECN-capable packet, returns 0 if packet is not ECN-capable */
+static int
+ecn_mark(unsigned char *packet, int plen)
+{
+	struct damper_ip_header *ip = (struct damper_ip_header *)packet;
+	uint16_t old, new;
+	uint32_t sum;
+
+	if ((plen < (int)sizeof(struct damper_ip_header)) || ((ip->ip_tos & ECN_MASK) == ECN_NOT_ECT)) {
+		return 0;
+	}
+
+	if ((ip->ip_tos & ECN_MASK) == ECN_CE) {
+		/* already marked */
+		return 1;
+	}
+
+	/* first 16-bit word of header holds TOS, update checksum incrementally (RFC 1624) */
+	memcpy(&old, packet, sizeof(uint16_t));
+	ip->ip_tos |= ECN_CE;
+	memcpy(&new, packet, sizeof(uint16_t));
+
+	sum = (uint16_t)~ip->ip_sum + (uint16_t)~old + new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	ip->ip_sum = ~sum;
+
+	return 1;
+}
+
+/* congestion signal: ECN-capable packets are marked and accepted, other dropped.
+   called with u->lock held */
+static void
+congestion_drop(struct userdata *u, int id, unsigned char *packet, int size, uint32_t mark)
+{
+	int vres;
+
+	if (u->ecn && ecn_mark(packet, size)) {
+		vres = nfq_set_verdict2(u->qh, id, NF_ACCEPT, mark, size, packet);
+
+		/* packet is sent beyond the limit, sender thread will compensate */
+		u->bypass_octets += size;
+
+		if (u->stat) {
+			u->stat_info.packets_pass += 1;
+			u->stat_info.octets_pass += size;
+			stat_top(u, packet, size, 1);
+		}
+	} else {
+		vres = nfq_set_verdict(u->qh, id, NF_DROP, 0, NULL);
+
+		if (u->stat) {
+			u->stat_info.packets_drop += 1;
+			u->stat_info.octets_drop += size;
+			stat_top(u, packet, size, 0);
+		}
+	}
+
+	if (vres < 0) {
+		fprintf(stderr, "nfq_set_verdict() failed, %s\n", strerror(errno));
+	}
+}
+
+/* accept packet without queueing, called with u->lock held */
+static void
+accept_now(struct userdata *u, int id, char *packet, int size, uint32_t mark)
+{
+	if (nfq_set_verdict2(u->qh, id, NF_ACCEPT, mark, size, (unsigned char *)packet) < 0) {
+		fprintf(stderr, "nfq_set_verdict2() failed, %s\n", strerror(errno));
+	}
+
+	if (u->stat) {
+		u->stat_info.packets_pass += 1;
+		u->stat_info.octets_pass += size;
+		stat_top(u, packet, size, 1);
+	}
+}
+
+#define TCP_ACK 0x10
+#define TCP_OPT_SACK 5
+
+/* check if packet is pure TCP ACK, which can be replaced by newer
+   cumulative ACK. ACKs with SACK blocks or ECN flags are never replaced */
+static int
+ack_thinnable(char *packet, int plen, uint32_t *ack)
+{
+	struct damper_ip_header *ip;
+	int ip_hdrlen, tcp_hdrlen;
+	unsigned char *tcp, *opt;
+
+	if (plen < (int)sizeof(struct damper_ip_header)) {
+		return 0;
+	}
+
+	ip = (struct damper_ip_header *)packet;
+	ip_hdrlen = (ip->ip_vhl & 0x0f) * 4;
+
+	if ((ip->ip_p != TCP_PROTO_NUM) || (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK))
+		|| (ip_hdrlen < 20) || (plen < ip_hdrlen + 20)) {
+		return 0;
+	}
+
+	tcp = (unsigned char *)packet + ip_hdrlen;
+	tcp_hdrlen = (tcp[12] >> 4) * 4;
+
+	/* only ACK flag (PSH allowed) and no payload, options are inside packet */
+	if ((tcp_hdrlen < 20) || ((tcp[13] & ~0x08) != TCP_ACK) || (plen != ip_hdrlen + tcp_hdrlen)) {
+		return 0;
+	}
+
+	/* search for SACK option */
+	opt = tcp + 20;
+	while (opt < tcp + tcp_hdrlen) {
+		if (*opt == 0) {
+			/* end of options */
+			break;
+		} else if (*opt == 1) {
+			/* no-operation */
+			opt++;
+			continue;
+		} else if (*opt == TCP_OPT_SACK) {
+			return 0;
+		}
+		if ((opt + 1 >= tcp + tcp_hdrlen) || (opt[1] < 2)) {
+			break;
+		}
+		opt += opt[1];
+	}
+
+	*ack = ntohl(*(uint32_t *)(tcp + 8));
+
+	return 1;
+}
+
+/* replace queued pure ACK of the same flow with newer one */
+static int
+ack_thin(struct userdata *u, struct flow_key *key, uint32_t ack,
+	char *packet, int id, int plen, uint32_t mark, double prio, uint64_t now)
+{
+	size_t i;
+
+	for (i=0; i<u->qlen; i++) {
+		struct mpacket *mp = &u->packets[i];
+		int vres;
+
+		if ((u->prioarray[i] == DBL_MIN) || (!mp->thin)) {
+			continue;
+		}
+		/* ACK must be newer, duplicate ACKs are used for fast retransmit */
+		if (((int32_t)(ack - mp->ack) <= 0) || (memcmp(key, &mp->key, sizeof(struct flow_key)) != 0)) {
+			continue;
+		}
+
+		/* drop older ACK */
+		vres = nfq_set_verdict(u->qh, mp->id, NF_DROP, 0, NULL);
+		if (vres < 0) {
+			fprintf(stderr, "nfq_set_verdict() failed, %s\n", strerror(errno));
+		}
+
+		if (u->stat) {
+			u->stat_info.packets_drop += 1;
+			u->stat_info.octets_drop += mp->size;
+			stat_top(u, mp->packet, mp->size, 0);
+		}
+
+		/* and put new one in its place */
+		if (prio > u->prioarray[i]) {
+			u->prioarray[i] = prio;
+		}
+		u->qoctets += plen - mp->size;
+		mp->qtime = now;
+		mp->size = plen;
+		mp->id = id;
+		mp->mark = mark;
+		mp->ack = ack;
+		memcpy(mp->packet, packet, plen);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+add_to_queue(struct userdata *u, char *packet, int id,
+	int plen, uint32_t mark, double prio)
+{
+	size_t i, idx = 0;
+	double min = DBL_MAX;
+	int thin = 0;
+	uint32_t ack = 0;
+	struct flow_key key;
+	uint64_t now = 0;
+
+	if (u->stat) {
+		now = stat_clock();
+		stat_queue_time(u, now);
+	}
+
+	if (u->ackthin) {
+		thin = ack_thinnable(packet, plen, &ack);
+		if (thin) {
+			flow_key_parse(packet, plen, &key);
+			if (ack_thin(u, &key, ack, packet, id, plen, mark, prio, now)) {
+				goto done;
+			}
+		}
+	}
+
+	/* search for packet with minimum priority */
+	for (i=0; i<u->qlen; i++) {
+		if (min > u->prioarray[i]) {
+			min = u->prioarray[i];
+			idx = i;
+		}
+	}
+
+	/* and replace it with new packet */
+	if (min < prio) {
+		if (min != DBL_MIN) {
+			/* drop (or mark) packet */
+			congestion_drop(u, u->packets[idx].id, u->packets[idx].packet,
+				u->packets[idx].size, u->packets[idx].mark);
+			u->qoctets -= u->packets[idx].size;
+		} else {
+			u->nqueued++;
+		}
+		u->qoctets += plen;
+		u->packets[idx].qtime = now;
+
+		u->prioarray[idx] = prio;
+		u->packets[idx].size = plen;
+		u->packets[idx].id = id;
+		u->packets[idx].mark = mark;
+		memcpy(u->packets[idx].packet, packet, plen);
+
+		u->packets[idx].thin = thin;
+		if (thin) {
+			u->packets[idx].ack = ack;
+			u->packets[idx].key = key;
+		}
+	}
+
+done:
+	if (u->stat) {
+		stat_queue_level(u);
+	}
+}
+
+/* decide if flow can bypass damper, returns packet mark for verdict */
+static uint32_t
+offload_mark(struct userdata *u, struct flow_entry *fe, double weight, uint32_t mark)
+{
+	double dev, wavg;
+
+	mark &= ~u->offload_mask;
+
+	fe->packets++;
+	if (fe->packets == 1) {
+		fe->wavg = weight;
+		fe->wdev = weight;
+		return mark;
+	}
+
+	dev = fabs(weight - fe->wavg);
+	fe->wavg += (weight - fe->wavg) / 8.0f;
+	fe->wdev += (dev - fe->wdev) / 8.0f;
+
+	/* updated under u->lock, which is not held here */
+	__atomic_load(&u->wavg, &wavg, __ATOMIC_RELAXED);
+
+	if ((fe->packets >= u->offload_packets)
+		&& (fe->wdev < fe->wavg * OFFLOAD_DEV)
+		&& (fe->wavg < wavg)) {
+
+		/* weight settled below average, bulk flow */
+		mark |= u->offload_bulk;
+	}
+
+	return mark;
+}
+
+/* mark for packet verdict: bits owned by damper are cleared, bulk flow is tagged
+   if flow is known */
+static uint32_t
+verdict_mark(struct userdata *u, struct flow_entry *fe, double weight, uint32_t mark)
+{
+	if (u->offload_bulk && fe && (weight >= 0)) {
+		return offload_mark(u, fe, weight, mark);
+	}
+
+	return mark & ~u->offload_mask;
+}
+
+#define NLA_DATA(A) ((void *)((char *)(A) + NLA_HDRLEN))
+#define NLA_LEN(A)  ((int)(A)->nla_len - NLA_HDRLEN)
+
+/* search for netlink attribute */
+static struct nlattr *
+nla_find(void *head, int len, int type)
+{
+	struct nlattr *a = head;
+
+	while ((len >= NLA_HDRLEN) && (a->nla_len >= NLA_HDRLEN) && (a->nla_len <= len)) {
+		if ((a->nla_type & NLA_TYPE_MASK) == type) {
+			return a;
+		}
+		len -= NLA_ALIGN(a->nla_len);
+		a = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len));
+	}
+
+	return NULL;
+}
+
+/* search for nested attribute */
+static struct nlattr *
+nla_find_nested(struct nlattr *parent, int type)
+{
+	if (!parent) {
+		return NULL;
+	}
+	return nla_find(NLA_DATA(parent), NLA_LEN(parent), type);
+}
+
+/* fill flow key from conntrack entry attached to packet (NFQA_CT).
+   returns 0 if there is no conntrack info */
+static int
+ct_flow_key(struct nfgenmsg *nfmsg, struct flow_key *key, int *closed)
+{
+	struct nlmsghdr *nlh;
+	struct nlattr *ct, *a, *tuple, *t;
+	int len;
+
+	/* libnetfilter_queue passes pointer to payload of netlink message */
+	nlh = (struct nlmsghdr *)((char *)nfmsg - NLMSG_HDRLEN);
+	len = (int)nlh->nlmsg_len - NLMSG_HDRLEN - NLMSG_ALIGN(sizeof(struct nfgenmsg));
+
+	ct = nla_find((char *)nfmsg + NLMSG_ALIGN(sizeof(struct nfgenmsg)), len, NFQA_CT);
+	a = nla_find_nested(ct, CTA_ID);
+	if (!a || (NLA_LEN(a) < (int)sizeof(uint32_t))) {
+		return 0;
+	}
+	key->ctid = ntohl(*(uint32_t *)NLA_DATA(a));
+
+	/* original direction tuple, before NAT */
+	tuple = nla_find_nested(ct, CTA_TUPLE_ORIG);
+
+	t = nla_find_nested(tuple, CTA_TUPLE_IP);
+	if ((a = nla_find_nested(t, CTA_IP_V4_SRC))) {
+		key->saddr = *(uint32_t *)NLA_DATA(a);
+	}
+	if ((a = nla_find_nested(t, CTA_IP_V4_DST))) {
+		key->daddr = *(uint32_t *)NLA_DATA(a);
 	}
 
-	/* init modules */
-	for (i=0; modules[i].name; i++) {
-		if (modules[i].init) {
-			/* default multiplicator */
-			modules[i].k = 1.0f;
+	t = nla_find_nested(tuple, CTA_TUPLE_PROTO);
+	if ((a = nla_find_nested(t, CTA_PROTO_NUM))) {
+		key->proto = *(uint8_t *)NLA_DATA(a);
+	}
+	if ((a = nla_find_nested(t, CTA_PROTO_SRC_PORT))) {
+		key->sport = ntohs(*(uint16_t *)NLA_DATA(a));
+	}
+	if ((a = nla_find_nested(t, CTA_PROTO_DST_PORT))) {
+		key->dport = ntohs(*(uint16_t *)NLA_DATA(a));
+	}
 
-			modules[i].mptr = (modules[i].init)(u, i);
-		} else {
-			modules[i].mptr = NULL;
+	/* connection is going away, so its state can be freed */
+	*closed = 0;
+	if ((a = nla_find_nested(ct, CTA_STATUS))) {
+		if (ntohl(*(uint32_t *)NLA_DATA(a)) & IPS_DYING) {
+			*closed = 1;
 		}
 	}
+	t = nla_find_nested(nla_find_nested(ct, CTA_PROTOINFO), CTA_PROTOINFO_TCP);
+	if ((a = nla_find_nested(t, CTA_PROTOINFO_TCP_STATE))) {
+		uint8_t state = *(uint8_t *)NLA_DATA(a);
 
-	if (!config_read(u, confname)) {
-		goto fail_conf;
+		if ((state == TCP_CONNTRACK_TIME_WAIT) || (state == TCP_CONNTRACK_CLOSE)) {
+			*closed = 1;
+		}
 	}
 
-	if (u->limit == 0) {
-		fprintf(stderr, "Something is wrong with limit, all traffic will be blocked\n");
+	return 1;
+}
+
+/* flow lookup, module weights and verdict for packet, modules before 'first'
+   were called for whole batch. called by capture thread or by worker which owns
+   packet's flow */
+static void
+packet_weigh(struct userdata *u, struct pkt_desc *d, double bweight, int bhints, size_t first)
+{
+	int id = d->id, plen = d->size;
+	char *p = d->packet;
+	uint32_t mark = d->mark;
+	double weight;
+	size_t i;
+	struct flow_entry *fe[FLOWTAB_MAX];
+	struct flow_entry *cfe = NULL;
+	uint32_t now, now_ms = 0;
+	int hints;
+	struct weigh_ctx c;
+
+	/* one lookup in each flow table serves all modules */
+	now = time(NULL);
+	for (i=0; i<u->nflowtabs; i++) {
+		fe[i] = flowtab_lookup(&u->flowtabs[i], &d->key, now);
 	}
 
-	if (u->nfqlen == 0) {
-		u->nfqlen = NFQ_DEFLEN;
+	c.u = u;
+	c.fe = fe;
+	c.packet = p;
+	c.packetlen = plen;
+	c.mark = mark;
+	c.cached = 0;
+	c.complete = 1;
+	c.first = first;
+	c.weight = DBL_EPSILON + bweight;
+	c.hints = bhints;
+	c.fweight = DBL_EPSILON;
+	c.fhints = 0;
+
+	if (bweight < 0.0) {
+		/* dropped by module with batch function */
+		c.weight = bweight;
 	}
 
-	/* setup statistics */
-	if (u->stat) {
-		if (u->keep_stat == 0) {
-			fprintf(stderr, "'keepstat' not set, statistics will be kept for %d days\n", KEEP_STAT);
-			u->keep_stat = KEEP_STAT;
+	if (u->coreft && (u->wcache_packets || u->wcache_ms)) {
+		cfe = fe[u->coreft - u->flowtabs];
+
+		if (u->wcache_ms) {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 		}
-		stat_init(u);
-	}
 
-	/* reserve memory for packets in queue */
-	u->packets = malloc(u->qlen * sizeof(struct mpacket));
-	if (!u->packets) {
-		fprintf(stderr, "malloc(%lu) failed\n", (long)u->qlen * sizeof(struct mpacket));
-		goto fail_packets;
+		if ((cfe->wc_left > 0) && ((!u->wcache_ms) || ((now_ms - cfe->wc_time) < u->wcache_ms))) {
+			/* only per-packet modules are called */
+			c.cached = 1;
+			cfe->wc_left--;
+			if (c.weight >= 0) {
+				c.weight = cfe->wcache + bweight;
+			}
+			c.hints |= cfe->wc_hints;
+		}
 	}
 
-	/* create priority array - simplified implementation of priority queue */
-	u->prioarray = malloc(u->qlen * sizeof(double));
-	if (!u->prioarray) {
-		fprintf(stderr, "malloc(%lu) failed\n", (long)u->qlen * sizeof(double));
-		goto fail_prio_array;
+	/* calculate weight for each enabled module */
+	if (u->static_pipeline) {
+#ifdef DAMPER_STATIC_PIPELINE
+		modules_weigh(&c);
+#endif
+	} else {
+		for (i=0; modules[i].name; i++) {
+			if (modules[i].weight && !weigh_step(&c, i, modules[i].weight, modules[i].k)) {
+				break;
+			}
+		}
 	}
-	/* fill priority array with minimal possible values */
-	for (i=0; i<u->qlen; i++) {
-		u->prioarray[i] = DBL_MIN;
+	weight = c.weight;
+	hints = c.hints;
+
+	if (cfe) {
+		if ((hints & HINT_REFRESH) || (!c.cached && !c.complete)) {
+			/* recompute on next packet, also when hint of per-packet module
+			   skipped per-flow ones and fweight is partial */
+			cfe->wc_left = 0;
+		} else if (!c.cached && (weight >= 0)) {
+			cfe->wcache = c.fweight;
+			cfe->wc_hints = c.fhints & (HINT_ACCEPT | HINT_FINAL);
+			cfe->wc_left = u->wcache_packets ? u->wcache_packets : UINT32_MAX;
+			cfe->wc_time = now_ms;
+		}
 	}
 
-	/* init mutex */
-	pthread_mutex_init(&u->lock, NULL);
-
-	/* configuration done, notify modules */
-	for (i=0; modules[i].name; i++) {
-		if (modules[i].postconf) {
-			int mres;
+	mark = verdict_mark(u, u->coreft ? fe[u->coreft - u->flowtabs] : NULL, weight, mark);
 
-			mres = (modules[i].postconf)(modules[i].mptr);
-			if (!mres) {
-				/* disable module */
-				fprintf(stderr, "Module '%s': initialization failed, disabling\n", modules[i].name);
-				modules[i].enabled = 0;
-			} else {
-				modules[i].enabled = 1;
-			}
+	for (i=0; i<u->nflowtabs; i++) {
+		if (d->closed && (u->flowtabs[i].fkey == FLOW_KEY_5TUPLE)) {
+			/* connection closed, flow keyed by conntrack id will never be seen again */
+			flowtab_remove(&u->flowtabs[i], fe[i]);
 		}
+		flowtab_release(&u->flowtabs[i], fe[i]);
 	}
 
-	return u;
+	pthread_mutex_lock(&u->lock);
+	if (!d->fast) {
+		u->inflight--;
+	}
+	if (u->offload_bulk && (weight >= 0)) {
+		double wavg = u->wavg + (weight - u->wavg) / OFFLOAD_AVG_PACKETS;
 
-	free(u->prioarray);
-fail_prio_array:
-	free(u->packets);
-fail_packets:
-fail_conf:
-	free(u);
-fail_create:
+		__atomic_store(&u->wavg, &wavg, __ATOMIC_RELAXED);
+	}
 
-	return NULL;
+	if (weight < 0) {
+		if (d->fast) {
+			u->fp_tokens += plen;
+		}
+		/* drop (or mark) packet with with negative weight */
+		congestion_drop(u, id, (unsigned char *)p, plen, mark);
+	} else if (d->fast) {
+		/* tokens were taken for this packet */
+		accept_now(u, id, p, plen, mark);
+	} else if (hints & HINT_ACCEPT) {
+		/* module asked to accept packet without queueing, it still uses bandwidth */
+		accept_now(u, id, p, plen, mark);
+		u->bypass_octets += plen;
+	} else {
+		/* add to queue with positive weight */
+		add_to_queue(u, p, id, plen, mark, weight);
+	}
+	pthread_mutex_unlock(&u->lock);
 }
 
+/* weigh batch of packets. leading modules with batch function are called once
+   for all packets, in modules[] order, each with packets which are not decided
+   by previous ones. first module with flow state and the rest are called for
+   each packet */
 static void
-userdata_destroy(struct userdata *u)
+packets_weigh(struct userdata *u, struct pkt_desc *d, size_t n)
 {
-	size_t i;
+	struct weight_desc wd[PKT_BATCH], bd[PKT_BATCH];
+	double bw[PKT_BATCH], w[PKT_BATCH];
+	size_t idx[PKT_BATCH];
+	size_t i, j, a, na;
+
+	for (j=0; j<n; j++) {
+		wd[j].packet = d[j].packet;
+		wd[j].packetlen = d[j].size;
+		wd[j].mark = d[j].mark;
+		wd[j].hints = 0;
+		bw[j] = 0.0f;
+	}
 
 	for (i=0; modules[i].name; i++) {
-		if (modules[i].done) {
-			(modules[i].done)(modules[i].mptr);
+		uint32_t wh[STAT_WHIST_NBUCKETS];
+		int b;
+
+		if (!modules[i].enabled) {
+			continue;
 		}
-		if (modules[i].statf) {
-			fclose(modules[i].statf);
+		if (!module_batched(i)) {
+			/* this one and the rest are called for each packet */
+			break;
 		}
-	}
 
-	pthread_mutex_destroy(&u->lock);
+		/* packets dropped or decided by hint skip remaining modules */
+		na = 0;
+		for (j=0; j<n; j++) {
+			if ((bw[j] >= 0.0) && !(wd[j].hints & (HINT_ACCEPT | HINT_FINAL))) {
+				idx[na] = j;
+				bd[na++] = wd[j];
+			}
+		}
+		if (na == 0) {
+			continue;
+		}
 
-	if (u->stat) {
-		fclose(u->statf);
+		(modules[i].weight_batch)(modules[i].mptr, bd, na, w);
+
+		memset(wh, 0, sizeof(wh));
+		for (a=0; a<na; a++) {
+			j = idx[a];
+			wd[j].hints = bd[a].hints;
+			if (w[a] < 0.0) {
+				bw[j] = w[a];
+				continue;
+			}
+			bw[j] += w[a] * modules[i].k;
+			wh[stat_whist_bucket(w[a] * modules[i].k)]++;
+		}
+
+		/* batch is added at once, without lock */
+		for (b=0; u->wchart && (b<STAT_WHIST_NBUCKETS); b++) {
+			if (wh[b]) {
+				__sync_fetch_and_add(&modules[i].whist[b], wh[b]);
+			}
+		}
+	}
+
+	for (j=0; j<n; j++) {
+		packet_weigh(u, &d[j], bw[j], wd[j].hints, i);
 	}
-	free(u->prioarray);
-	free(u->packets);
-	free(u);
 }
 
 static void *
-sender_thread(void *arg)
+worker_thread(void *arg)
 {
-
-	struct userdata *u = arg;
-	int vres;
-	size_t i, idx = 0;
-	double max = DBL_MIN;
-	uint64_t limit;
-	uint64_t sleep_ns;
+	struct worker *w = arg;
 
 	for (;;) {
-		struct timespec ts;
-
-		pthread_mutex_lock(&u->lock);
-		limit = u->limit;
+		struct pkt_desc d[PKT_BATCH];
+		size_t j, n;
 
-		if ((limit == 0) || (limit == UINT64_MAX)) {
-			/* change limit to kbyte/sec, so will sleep about 0.1 sec */
-			limit = 1000;
+		pthread_mutex_lock(&w->lock);
+		while ((w->count == 0) && !damper_done) {
+			pthread_cond_wait(&w->nonempty, &w->lock);
 		}
-
-		/* search for packet with maximum priority */
-		max = DBL_MIN;
-		for (i=0; i<u->qlen; i++) {
-			if (max < u->prioarray[i]) {
-				max = u->prioarray[i];
-				idx = i;
-			}
+		if (w->count == 0) {
+			/* terminating, queue is drained */
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		n = (w->count < PKT_BATCH) ? w->count : PKT_BATCH;
+		for (j=0; j<n; j++) {
+			d[j] = w->ring[(w->head + j) % WORKER_RING].d;
 		}
+		pthread_mutex_unlock(&w->lock);
 
-		if (max != DBL_MIN) {
-			/* accept (send) packet */
-			vres = nfq_set_verdict(u->qh, u->packets[idx].id,
-				NF_ACCEPT, u->packets[idx].size, u->packets[idx].packet);
+		/* slots are not reused by capture thread until head is moved */
+		packets_weigh(w->u, d, n);
 
-			if (vres < 0) {
-				fprintf(stderr, "nfq_set_verdict() failed, %s\n", strerror(errno));
-			}
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head + n) % WORKER_RING;
+		w->count -= n;
+		pthread_cond_signal(&w->nonfull);
+		pthread_mutex_unlock(&w->lock);
+	}
 
-			/* mark packet buffer as empty */
-			u->prioarray[idx] = DBL_MIN;
+	return NULL;
+}
 
-			/* update statistics */
-			if (u->stat) {
-				u->stat_info.packets_pass += 1;
-				u->stat_info.octets_pass+= u->packets[idx].size;
-			}
-			sleep_ns = (u->packets[idx].size * BILLION) / limit;
-		} else {
-			/* no data to send, so just sleep for time required to transfer 100 bytes */
-			sleep_ns = 100 * BILLION / limit;
-		}
+/* pass packet to worker, packets of one flow always go to the same worker */
+static void
+worker_dispatch(struct userdata *u, struct pkt_desc *d)
+{
+	struct worker *w;
+	struct work_item *wi;
 
-		if (sleep_ns > BILLION) {
-			ts.tv_sec = sleep_ns / BILLION;
-			ts.tv_nsec = sleep_ns % BILLION;
-		} else {
-			ts.tv_sec = 0;
-			ts.tv_nsec = sleep_ns;
-		}
+	w = &u->workers[flow_hash(&d->key) % u->nworkers];
 
-		pthread_mutex_unlock(&u->lock);
-		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	pthread_mutex_lock(&w->lock);
+	while (w->count == WORKER_RING) {
+		/* worker is busy, kernel queue will hold the rest */
+		pthread_cond_wait(&w->nonfull, &w->lock);
 	}
 
-	return NULL;
-}
+	wi = &w->ring[(w->head + w->count) % WORKER_RING];
+	wi->d = *d;
+	wi->d.packet = (char *)wi->packet;
+	memcpy(wi->packet, d->packet, d->size);
 
+	w->count++;
+	pthread_cond_signal(&w->nonempty);
+	pthread_mutex_unlock(&w->lock);
+}
 
 static void
-add_to_queue(struct userdata *u, char *packet, int id,
-	int plen, double prio)
+workers_start(struct userdata *u)
 {
-	size_t i, idx = 0;
-	double min = DBL_MAX;
+	size_t i;
 
-	/* search for packet with minimum priority */
-	for (i=0; i<u->qlen; i++) {
-		if (min > u->prioarray[i]) {
-			min = u->prioarray[i];
-			idx = i;
-		}
+	for (i=0; i<u->nworkers; i++) {
+		pthread_create(&u->workers[i].tid, NULL, &worker_thread, &u->workers[i]);
 	}
+}
 
-	/* and replace it with new packet */
-	if (min < prio) {
-		if (min != DBL_MIN) {
-			int vres;
+static void
+workers_stop(struct userdata *u)
+{
+	size_t i;
 
-			/* drop packet */
-			vres = nfq_set_verdict(u->qh, u->packets[idx].id, NF_DROP, 0, NULL);
-			if (vres < 0) {
-				fprintf(stderr, "nfq_set_verdict() failed, %s\n", strerror(errno));
-			}
+	for (i=0; i<u->nworkers; i++) {
+		pthread_mutex_lock(&u->workers[i].lock);
+		pthread_cond_signal(&u->workers[i].nonempty);
+		pthread_mutex_unlock(&u->workers[i].lock);
 
-			if (u->stat) {
-				/* and update statistics */
-				u->stat_info.packets_drop += 1;
-				u->stat_info.octets_drop += u->packets[idx].size;
-			}
-		}
+		pthread_join(u->workers[i].tid, NULL);
+	}
+}
 
-		u->prioarray[idx] = prio;
-		u->packets[idx].size = plen;
-		u->packets[idx].id = id;
-		memcpy(u->packets[idx].packet, packet, plen);
+/* weigh packets collected by capture thread */
+static void
+packets_flush(struct userdata *u)
+{
+	if (u->npending > 0) {
+		packets_weigh(u, u->pending, u->npending);
+		u->npending = 0;
 	}
 }
 
@@ -607,9 +2571,8 @@ on_packet(struct nfq_q_handle *qh,
 	char *p;
 	uint32_t mark;
 	struct userdata *u;
-	double weight = DBL_EPSILON;
-	size_t i;
-	int wchartstat;
+	struct pkt_desc d;
+	int fast = 0, sampled = 0, done = 0;
 
 	struct nfqnl_msg_packet_hdr *ph = nfq_get_msg_packet_hdr(nfad);
 	if (ph) {
@@ -624,6 +2587,8 @@ on_packet(struct nfq_q_handle *qh,
 
 	u = data;
 
+	mark = nfq_get_nfmark(nfad);
+
 	/* there are two special cases:
 	limit == 0 (traffic disabled) and limit == UINT64_MAX (no shaping performed) */
 	pthread_mutex_lock(&u->lock);
@@ -635,71 +2600,83 @@ on_packet(struct nfq_q_handle *qh,
 		if (u->stat) {
 			u->stat_info.packets_drop += 1;
 			u->stat_info.octets_drop += plen;
+			stat_top(u, p, plen, 0);
 		}
+		done = 1;
 	} else 	if (u->limit == UINT64_MAX) {
-		/* accept packet */
-		nfq_set_verdict(u->qh, id, NF_ACCEPT, plen, (unsigned char *)p);
+		/* accept packet, flow can bypass damper */
+		nfq_set_verdict2(u->qh, id, NF_ACCEPT, (mark & ~u->offload_mask) | u->offload_unshaped,
+			plen, (unsigned char *)p);
 		/* and update statistics */
 		if (u->stat) {
 			u->stat_info.packets_pass += 1;
 			u->stat_info.octets_pass += plen;
+			stat_top(u, p, plen, 1);
 		}
+		done = 1;
+	} else if (u->fastpath && fastpath_take(u, plen)) {
+		/* link is not saturated, modules see only sampled packets */
+		fast = 1;
+		sampled = ((++u->fp_count % u->fp_sample) == 0);
+	} else {
+		/* packet waits for weight, fast path must not overtake it */
+		u->inflight++;
 	}
-	wchartstat = u->wchart;
 	pthread_mutex_unlock(&u->lock);
 
-	if ((u->limit == 0) || (u->limit == UINT64_MAX)) {
+	if (fast && !sampled) {
+		/* only one thread gives fast verdicts, next packet is read after this one */
+		double w = fastpath_policy(u, p, plen, mark);
+
+		pthread_mutex_lock(&u->lock);
+		if (w < 0.0) {
+			u->fp_tokens += plen;
+			congestion_drop(u, id, (unsigned char *)p, plen, mark);
+		} else {
+			accept_now(u, id, p, plen, verdict_mark(u, NULL, 0.0f, mark));
+		}
+		pthread_mutex_unlock(&u->lock);
 		return 1;
 	}
 
-	mark = nfq_get_nfmark(nfad);
-
-	/* calculate weight for each enabled module */
-	for (i=0; modules[i].name; i++) {
-		if (modules[i].weight && modules[i].enabled) {
-			double mweight = (modules[i].weight)(modules[i].mptr, p, plen, mark);
-
-			if (mweight < 0.0) {
-				weight = mweight;
-				break;
-			}
-			mweight *= modules[i].k;
-
-			if (wchartstat) {
-				pthread_mutex_lock(&u->lock);
-				modules[i].stw += mweight;
-				modules[i].nw  += 1.0f;
-				pthread_mutex_unlock(&u->lock);
-			}
+	if (done) {
+		return 1;
+	}
 
-			weight += mweight;
-		}
+	d.id = id;
+	d.mark = mark;
+	d.closed = 0;
+	d.fast = fast;
+	d.size = plen;
+	d.packet = p;
+	flow_key_parse(p, plen, &d.key);
+	if (u->conntrack) {
+		ct_flow_key(nfmsg, &d.key, &d.closed);
 	}
 
-	pthread_mutex_lock(&u->lock);
-	if (weight < 0) {
-		/* drop packet with with negative weight */
-		nfq_set_verdict(u->qh, id, NF_DROP, 0, NULL);
-		/* update statistics */
-		if (u->stat) {
-			u->stat_info.packets_drop += 1;
-			u->stat_info.octets_drop += plen;
-		}
+	if (fast) {
+		/* sampled fast packet, nothing is waiting, so weigh it in place */
+		packets_weigh(u, &d, 1);
+	} else if (u->nworkers) {
+		worker_dispatch(u, &d);
 	} else {
-		/* add to queue with positive weight */
-		add_to_queue(u, p, id, plen, weight);
+		/* packet stays in receive buffer until batch is weighed */
+		if (u->npending == PKT_BATCH) {
+			packets_flush(u);
+		}
+		u->pending[u->npending++] = d;
 	}
-	pthread_mutex_unlock(&u->lock);
 
 	return 1;
 }
 
+
 int
 main(int argc, char *argv[])
 {
 	struct nfq_handle *h;
 	int fd;
-	char buf[0xffff];
+	char (*bufs)[RECV_BUFSIZE];
 	int r = EXIT_FAILURE;
 	struct userdata *u;
 	struct sigaction action;
@@ -746,6 +2723,20 @@ main(int argc, char *argv[])
 		goto fail_mode;
 	}
 
+	if (u->conntrack) {
+		if (nfq_set_queue_flags(u->qh, NFQA_CFG_F_CONNTRACK, NFQA_CFG_F_CONNTRACK) < 0) {
+			fprintf(stderr, "nfq_set_queue_flags() failed, conntrack info disabled\n");
+			u->conntrack = 0;
+		}
+	}
+
+	/* packets waiting in socket are received at once and weighed in batch */
+	bufs = malloc(PKT_BATCH * RECV_BUFSIZE);
+	if (!bufs) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)PKT_BATCH * RECV_BUFSIZE);
+		goto fail_mode;
+	}
+
 	/* handle term and int signals */
 	memset(&action, 0, sizeof(struct sigaction));
 	action.sa_handler = on_term;
@@ -754,18 +2745,27 @@ main(int argc, char *argv[])
 	action.sa_handler = on_term;
 	sigaction(SIGINT, &action, NULL);
 
+	action.sa_handler = on_hup;
+	sigaction(SIGHUP, &action, NULL);
+
 	/* create sending thread */
 	pthread_create(&u->sender_tid, NULL, &sender_thread, u);
 	/* and thread for updating statistics */
 	pthread_create(&u->stat_tid, NULL, &stat_thread, u);
+	if (u->stat) {
+		pthread_create(&u->sday_tid, NULL, &stat_day_thread, u);
+	}
+	/* weights are computed by workers, if any */
+	workers_start(u);
 
 	fd = nfq_fd(h);
 	for (;;) {
-		int rv;
+		int rv[PKT_BATCH];
+		size_t i, nb;
 
-		rv = recv(fd, buf, sizeof(buf), 0);
-		if ((rv < 0) && (errno != EINTR)) {
-			fprintf(stderr, "recv() on queue returned %d (%s)\n", rv, strerror(errno));
+		rv[0] = recv(fd, bufs[0], RECV_BUFSIZE, 0);
+		if ((rv[0] < 0) && (errno != EINTR)) {
+			fprintf(stderr, "recv() on queue returned %d (%s)\n", rv[0], strerror(errno));
 			fprintf(stderr, "Queue full? Current queue size %d, you can increase 'nfqlen' parameter in damper.conf\n",
 				u->nfqlen);
 			continue; /* don't stop after error */
@@ -775,10 +2775,39 @@ main(int argc, char *argv[])
 			break;
 		}
 
-		nfq_handle_packet(h, buf, rv);
+		if (damper_reload) {
+			damper_reload = 0;
+			config_reload(u, argv[1]);
+		}
+
+		if (rv[0] < 0) {
+			continue;
+		}
+
+		for (nb=1; nb<PKT_BATCH; nb++) {
+			rv[nb] = recv(fd, bufs[nb], RECV_BUFSIZE, MSG_DONTWAIT);
+			if (rv[nb] <= 0) {
+				break;
+			}
+		}
+
+		for (i=0; i<nb; i++) {
+			nfq_handle_packet(h, bufs[i], rv[i]);
+		}
+		packets_flush(u);
 	}
 
+	free(bufs);
 	pthread_join(u->stat_tid, NULL);
+	if (u->stat) {
+		pthread_mutex_lock(&u->sday_lock);
+		pthread_cond_signal(&u->sday_cond);
+		pthread_mutex_unlock(&u->sday_lock);
+		pthread_join(u->sday_tid, NULL);
+	}
+	workers_stop(u);
+	/* packets in queue would be dropped with NFQUEUE, let them go */
+	queue_flush(u);
 	/* FIXME: sender thread? */
 
 	r = EXIT_SUCCESS;
@@ -13,6 +13,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <ctype.h>
+
+#include "statfile.h"
 
 /* IP header */
 struct damper_ip_header
@@ -34,9 +37,40 @@ struct damper_ip_header
 
 #define DAMPER_MAX_PACKET_SIZE 0xffff
 
+#define TCP_PROTO_NUM 6
+#define UDP_PROTO_NUM 17
+
+/* flow key fields */
+#define FLOW_KEY_SADDR  0x01
+#define FLOW_KEY_DADDR  0x02
+#define FLOW_KEY_PROTO  0x04
+#define FLOW_KEY_SPORT  0x08
+#define FLOW_KEY_DPORT  0x10
+
+#define FLOW_KEY_HOSTS  (FLOW_KEY_SADDR | FLOW_KEY_DADDR)
+#define FLOW_KEY_5TUPLE (FLOW_KEY_HOSTS | FLOW_KEY_PROTO | FLOW_KEY_SPORT | FLOW_KEY_DPORT)
+
+struct flow_key
+{
+	uint32_t saddr, daddr;
+	uint16_t sport, dport;
+	uint8_t  proto;
+	uint8_t  pad[3];        /* always zero, keys are compared with memcmp() */
+	uint32_t ctid;          /* conntrack id, 0 if packet has no conntrack info */
+};
+
 struct mpacket
 {
 	int id; /* ID assigned to packet by netfilter */
+	uint32_t mark; /* mark for verdict */
+
+	/* pure TCP ACK which can be replaced with newer one of the same flow */
+	int thin;
+	uint32_t ack;
+	struct flow_key key;
+
+	uint64_t qtime; /* enqueue time, ns, for sojourn statistics */
+
 	int size;
 	unsigned char packet[DAMPER_MAX_PACKET_SIZE];
 };
@@ -44,10 +78,47 @@ struct mpacket
 
 struct stat_info
 {
-	uint32_t packets_pass, octets_pass;
-	uint32_t packets_drop, octets_drop;
-} __attribute__((packed));
+	uint64_t packets_pass, octets_pass;
+	uint64_t packets_drop, octets_drop;
+};
+
+/* queue occupancy and sojourn times of current second */
+struct stat_queue
+{
+	uint64_t packets_min, packets_max;
+	uint64_t octets_min, octets_max;
+	uint64_t packets_area, octets_area;  /* sums of value * ns, for average */
+	uint64_t time;                       /* ns in areas */
+	uint64_t last;                       /* time of last area update, ns */
+	uint64_t sojourn_max;                /* microseconds */
+	uint64_t hist[STAT_HIST_NBUCKETS];
+};
+
+
+/* mapped statistics file, see statfile.h */
+struct stat_mfile
+{
+	unsigned char *map;
+	size_t maplen;
+	uint64_t **col;             /* columns of series, weights are double */
+};
+
+/* statistics files of one day: each second, minute and hour rollups */
+#define STAT_NRES 3
+
+struct stat_day
+{
+	int day;                    /* DDMMYY, 0 if not mapped */
+	time_t start;               /* second when day starts */
+	struct stat_mfile f[STAT_NRES];
+	unsigned char *top;         /* top talkers file, if enabled */
+	size_t toplen;
+};
 
+struct flowtab;
+struct top_sketch;
+struct worker;
+struct pkt_desc;
 
 struct userdata
 {
@@ -58,6 +129,12 @@ struct userdata
 	struct mpacket *packets;
 	double *prioarray;
 	size_t qlen;
+	size_t nqueued;          /* packets in queue */
+	size_t inflight;         /* packets pending or in workers, not weighed yet */
+	uint64_t qoctets;        /* octets in queue */
+
+	struct pkt_desc *pending; /* received packets waiting for weight */
+	size_t npending;
 
 	uint64_t limit;
 
@@ -66,26 +143,108 @@ struct userdata
 
 	int stat;                   /* enable statistics */
 	int keep_stat;              /* how many days keep statistics */
+	int keep_rollup;            /* how many days keep minute and hour rollups */
+
+	/* statistics records shorter than second, kept in ring for fine_window seconds */
+	int stat_ms;                /* milliseconds per record, 1000 if ring is disabled */
+	int fine_window;
+	struct stat_mfile sfine;
+
+	unsigned char *slive;       /* live ring for viewers, see statfile.h */
+	size_t slivelen;
+
+	/* top talkers of each minute, host pairs and flows */
+	int ntop;                   /* keys written for each minute, 0 if disabled */
+	struct top_sketch *top[2];  /* updated under lock */
+	struct top_sketch *top_spare[2];  /* previous minute, written by stat thread */
 	char statdir[PATH_MAX];
 
 	struct stat_info stat_info;
-	time_t curr_timestamp, old_timestamp;
+	struct stat_queue stat_queue;
+	time_t curr_timestamp;
 
-	FILE *statf;                /* stats file */
-	int   cday;                 /* current day for stats */
-	time_t daystart;            /* second when current day was started */
+	/* mmap'd day files, current one and next one prepared by sday_tid */
+	struct stat_day sday[2];
+	int sday_cur;
+	time_t sday_now;            /* last written second */
+	pthread_t sday_tid;
+	pthread_mutex_t sday_lock;
+	pthread_cond_t sday_cond;
 
 	int wchart;                 /* enable weights chart */
+	uint64_t *wrollup;          /* weight histograms of current minute and hour, for stat thread */
+	time_t wrollup_rec[STAT_NRES - 1];
+	int conntrack;              /* request conntrack info from kernel */
+	int ackthin;                /* replace queued pure ACKs with newer ones */
+	int ecn;                    /* mark ECN-capable packets instead of dropping */
+	uint64_t bypass_octets;     /* octets sent out of turn (ECN-marked or accepted by hint) */
+
+	size_t nflows;              /* size of flow tables */
+	struct flowtab *flowtabs;   /* one table for each distinct flow key */
+	size_t nflowtabs;
+	struct flowtab *coreft;     /* 5-tuple table with core flow state */
+
+	/* flow offload: packet marks for flows which can bypass damper */
+	uint32_t offload_bulk;      /* weight of flow settled below average */
+	uint32_t offload_unshaped;  /* flow passed without shaping */
+	uint32_t offload_mask;      /* mark bits owned by damper */
+	uint32_t offload_packets;   /* packets before flow weight is considered settled */
+	double wavg;                /* average packet weight, read atomically without lock */
+
+	char snapshot[PATH_MAX];    /* flow state is saved here on exit and loaded on start */
+
+	int static_pipeline;        /* modules are called by modules_weigh() */
+
+	/* per-flow weight cache, refreshed every wcache_packets packets or wcache_ms */
+	uint32_t wcache_packets;
+	uint32_t wcache_ms;
+
+	/* weights are computed by workers, each flow is handled by one worker */
+	size_t nworkers;
+	struct worker *workers;
+
+	/* fast path: packets are accepted in place while link is not saturated */
+	int fastpath;
+	uint64_t fp_burst;          /* token bucket size, octets */
+	uint32_t fp_sample;         /* every n-th fast packet is passed to modules */
+	uint32_t fp_count;
+	double fp_tokens;
+	struct timespec fp_time;    /* last token bucket update */
 };
 
 /* modules */
 
+/* postconf returns 1 if module is ready, 0 on error or MODULE_UNUSED */
+#define MODULE_UNUSED (-1)  /* module is not configured, disabled quietly */
+
 typedef void * (*module_init_func)    (struct userdata *, size_t n);
 typedef void   (*module_conf_func)    (void *, char *param1, char *param2);
 typedef int    (*module_postconf_func)(void *);
-typedef double (*module_weight_func)  (void *, char *packet, int packetlen, int mark);
+typedef double (*module_weight_func)  (void *, char *packet, int packetlen, int mark, void *flow, int *hints);
 typedef void   (*module_done_func)    (void *);
 
+/* packet for batch weight function, module adds hints */
+struct weight_desc
+{
+	char *packet;
+	int packetlen;
+	int mark;
+	int hints;
+};
+
+/* weights of n packets to w[], for modules without flow state */
+typedef void   (*module_weight_batch_func)(void *, struct weight_desc *d, size_t n, double *w);
+
+/* hints which weight function may set, negative weight still means drop */
+#define HINT_ACCEPT 0x01   /* accept packet now, without queueing */
+#define HINT_FINAL  0x02   /* weight is final, skip remaining modules */
+#define HINT_REFRESH 0x04  /* flow state changed, don't use cached flow weight */
+
+/* called when flow is evicted from table, before its state is cleared */
+typedef void   (*flow_evict_func)     (void *, struct flow_key *key, void *flow);
+/* called for each flow loaded from snapshot */
+typedef void   (*flow_restore_func)   (void *, struct flow_key *key, void *flow);
+
 struct module_info
 {
 	char *name;
@@ -100,12 +259,26 @@ struct module_info
 	void *mptr;
 	int enabled;
 
-	FILE *statf;
-	double stw;           /* sum of weights per second */
-	double nw;            /* number of weight samples per second */
+	/* weights of current second by stat_whist_bucket(), updated atomically */
+	uint32_t whist[STAT_WHIST_NBUCKETS];
+
+	int perpacket;        /* weight depends on packet, not on flow, so it is never cached */
+	int policy;           /* drops or accepts by rule, called for fast path packets too */
+	module_weight_batch_func weight_batch;  /* optional, set in constructor */
+
+	/* per-flow state, see flow_register() */
+	int fkey;                /* flow key fields, 0 if module has no flow state */
+	size_t fsize;            /* size of per-flow state */
+	flow_evict_func fevict;
+	flow_restore_func frestore;  /* optional, set in constructor */
+	struct flowtab *ft;      /* table with module state */
+	size_t foff;             /* offset of module state in flow entry */
 };
 
 extern struct module_info modules[];
 
+/* request per-flow state of 'size' bytes for module 'n', flow identified by 'fkey' fields */
+void flow_register(size_t n, int fkey, size_t size, flow_evict_func evict);
+
 #endif
 
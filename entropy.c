@@ -1,28 +1,18 @@
-#define TCP_PROTO_NUM 6
-#define UDP_PROTO_NUM 17
-
-
+/* per-flow state */
 struct entflow
 {
-	uint32_t saddr, daddr;
-	uint16_t proto;
-	uint16_t sport, dport;
 	uint32_t stream_len;
 	uint32_t map[256]; /* symbols map */
-} __attribute__((packed));
+};
 
 struct entropy
 {
 	size_t module_number;
 
-	struct entflow *recent_flows;
-	int nflows;
-	int currflow;     /* pointer to current entry in flows circular buffer */
 	int sport, dport; /* override packet values with values from config */
 
 	int debug;
 	pthread_t debug_tid;
-	pthread_mutex_t lock;
 
 	char *statdir;
 	FILE *fdbg;
@@ -71,14 +61,12 @@ entropy_init(struct userdata *u, size_t n)
 		goto fail_alloc;
 	}
 
-	data->nflows = 0;
-	data->currflow = 0;
-
 	data->debug = 0;
 	data->module_number = n;
 	data->statdir = u->statdir;
 	data->sport = data->dport = -1;
-	pthread_mutex_init(&data->lock, NULL);
+
+	flow_register(n, FLOW_KEY_5TUPLE, sizeof(struct entflow), NULL);
 
 	return data;
 
@@ -92,7 +80,8 @@ entropy_conf(void *arg, char *param1, char *param2)
 	struct entropy *data = arg;
 
 	if (!strcmp(param1, "nrecent")) {
-		data->nflows = atoi(param2);
+		fprintf(stderr, "Module %s: 'nrecent' is obsolete, number of flows is set by 'flows'\n",
+			modules[data->module_number].name);
 	} else if (!strcmp(param1, "debug")) {
 		data->debug = atoi(param2);
 		if (data->debug <= 0) {
@@ -102,20 +91,38 @@ entropy_conf(void *arg, char *param1, char *param2)
 			data->debug = 0;
 		}
 	} else if (!strcmp(param1, "sport")) {
+		/* overridden port is not a part of flow key */
 		data->sport = atoi(param2);
+		modules[data->module_number].fkey &= ~FLOW_KEY_SPORT;
 	} else if (!strcmp(param1, "dport")) {
 		data->dport = atoi(param2);
+		modules[data->module_number].fkey &= ~FLOW_KEY_DPORT;
 	} else {
 		fprintf(stderr, "Module %s: unknown config parameter '%s'\n",
 			modules[data->module_number].name, param1);
 	}
 }
 
+static void
+entropy_debug_flow(struct flow_key *key, void *flow, void *arg)
+{
+	struct entropy *data = arg;
+	struct in_addr saddr, daddr;
+	int sport, dport;
+
+	saddr.s_addr = key->saddr;
+	daddr.s_addr = key->daddr;
+	sport = (data->sport == -1) ? key->sport : data->sport;
+	dport = (data->dport == -1) ? key->dport : data->dport;
+
+	fprintf(data->fdbg, "[prot: %3d %s:%d =>\t", key->proto, inet_ntoa(saddr), sport);
+	fprintf(data->fdbg, "%s:%d] %f\n", inet_ntoa(daddr), dport, entropy_calc(flow));
+}
+
 void *
 entropy_debug(void *arg)
 {
 	struct entropy *data = arg;
-	int i;
 
 	for (;;) {
 		time_t t;
@@ -123,28 +130,13 @@ entropy_debug(void *arg)
 		char tbuf[100];
 
 		sleep(data->debug);
-		pthread_mutex_lock(&data->lock);
 
 		time(&t);
 		tm_info = localtime(&t);
 		strftime(tbuf, sizeof(tbuf), "%Y:%m:%d %H:%M:%S", tm_info);
 
 		fprintf(data->fdbg, "%s\n", tbuf);
-		for (i=0; i<data->nflows; i++) {
-			struct in_addr saddr, daddr;
-			int proto, sport, dport;
-
-			saddr.s_addr = data->recent_flows[i].saddr;
-			daddr.s_addr = data->recent_flows[i].daddr;
-			proto = data->recent_flows[i].proto;
-			sport = data->recent_flows[i].sport;
-			dport = data->recent_flows[i].dport;
-
-			fprintf(data->fdbg, "%d: [prot: %3d %s:%d =>\t", i, proto, inet_ntoa(saddr), sport);
-			fprintf(data->fdbg, "%s:%d] %f\n", inet_ntoa(daddr), dport, entropy_calc(&data->recent_flows[i]));
-		}
-
-		pthread_mutex_unlock(&data->lock);
+		flow_foreach(data->module_number, &entropy_debug_flow, data);
 
 		fprintf(data->fdbg, "\n\n");
 		fflush(data->fdbg);
@@ -157,21 +149,6 @@ entropy_postconf(void *arg)
 {
 	struct entropy *data = arg;
 
-	if (data->nflows < 1) {
-		fprintf(stderr, "Module %s: incorrect value %d for number of recent flows\n",
-			modules[data->module_number].name, data->nflows);
-		goto fail;
-	}
-
-	/* create array of recent flows */
-	data->recent_flows = malloc(data->nflows * sizeof(struct entflow));
-	if (!data->recent_flows) {
-		fprintf(stderr, "Module %s: malloc() failed for %d recent flows\n",
-			modules[data->module_number].name, data->nflows);
-		goto fail;
-	}
-	memset(data->recent_flows, 0, data->nflows * sizeof(struct entflow));
-
 	if (data->debug) {
 		char debugfile[PATH_MAX];
 
@@ -199,95 +176,44 @@ entropy_free(void *arg)
 	if (data->debug) {
 		fclose(data->fdbg);
 	}
-	free(data->recent_flows);
 	free(data);
 }
 
 double
-entropy_weight(void *arg, char *packet, int packetlen, int mark)
+entropy_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
 {
 	double m;
-	unsigned int i;
-	uint32_t saddr, daddr;
-	int proto, sport, dport;
+	int proto;
 	struct damper_ip_header *ip;
 	int ip_hdrlen;
 	char *payload;
-	int found = 0;
-	struct entropy *data = arg;
+	struct entflow *f = flow;
 
 	ip = (struct damper_ip_header *)packet;
-	saddr = ip->ip_src.s_addr;
-	daddr = ip->ip_dst.s_addr;
 	proto = ip->ip_p;
 
 	ip_hdrlen = (ip->ip_vhl & 0x0f) * 4;
-	if ((proto == TCP_PROTO_NUM) || (proto == UDP_PROTO_NUM)) {
-		char *tcp_udp;
-
-		tcp_udp = packet + ip_hdrlen;
-		sport = (data->sport == -1) ? ntohs(*((uint16_t *)(tcp_udp)))
-			: data->sport;
-		dport = (data->dport == -1) ? ntohs(*((uint16_t *)(tcp_udp + sizeof(uint16_t))))
-			: data->dport;
-
-		if (proto == TCP_PROTO_NUM) {
-			payload = tcp_udp + 20; /* incorrect, payload may include tcp options */
-		} else {
-			payload = tcp_udp + 8;
-		}
+	if (proto == TCP_PROTO_NUM) {
+		payload = packet + ip_hdrlen + 20; /* incorrect, payload may include tcp options */
+	} else if (proto == UDP_PROTO_NUM) {
+		payload = packet + ip_hdrlen + 8;
 	} else {
-		sport = 0;
-		dport = 0;
 		payload = packet + ip_hdrlen;
 	}
 
-	if (data->debug) {
-		pthread_mutex_lock(&data->lock);
-	}
-
-	for (i=0; i<data->nflows; i++) {
-		if ((saddr == data->recent_flows[i].saddr) && (daddr == data->recent_flows[i].daddr)
-			&& (proto == data->recent_flows[i].proto)
-			&& (sport == data->recent_flows[i].sport) && (dport == data->recent_flows[i].dport)) {
-
-			data->recent_flows[i].stream_len += packetlen - (payload - packet);
-			found = 1;
-			break;
-		}
-	}
-
-	if (!found) {
-		i = data->currflow;
-
-		data->recent_flows[i].saddr = saddr;
-		data->recent_flows[i].daddr = daddr;
-		data->recent_flows[i].proto = proto;
-		data->recent_flows[i].sport = sport;
-		data->recent_flows[i].dport = dport;
-		memset(data->recent_flows[i].map, 0, sizeof(uint32_t) * 256);
-		data->recent_flows[i].stream_len = packetlen - (payload - packet);
-
-		data->currflow++;
-		if (data->currflow >= data->nflows) {
-			data->currflow = 0;
-		}
+	if ((payload - packet) < packetlen) {
+		f->stream_len += packetlen - (payload - packet);
 	}
 
 	/* update symbols map */
 	while ((payload - packet) < packetlen) {
-		data->recent_flows[i].map[(unsigned char)(*payload)]++;
+		f->map[(unsigned char)(*payload)]++;
 		payload++;
 	}
 
 	/* and calculate entropy */
-	m = entropy_calc(&data->recent_flows[i]);
-
-	if (data->debug) {
-		pthread_mutex_unlock(&data->lock);
-	}
+	m = entropy_calc(f);
 
 	return m;
 }
 
-
@@ -0,0 +1,533 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "flowtab.h"
+
+#define ALIGN8(X) (((X) + 7) & ~((size_t)7))
+
+#define FLOW_ENTRY(FT, IDX) ((struct flow_entry *)((FT)->arena + (IDX) * (FT)->entsize))
+
+void
+flow_register(size_t n, int fkey, size_t size, flow_evict_func evict)
+{
+	modules[n].fkey = fkey;
+	modules[n].fsize = size;
+	modules[n].fevict = evict;
+}
+
+void
+flow_key_parse(char *packet, int packetlen, struct flow_key *key)
+{
+	struct damper_ip_header *ip;
+	int ip_hdrlen;
+
+	memset(key, 0, sizeof(struct flow_key));
+
+	if (packetlen < (int)sizeof(struct damper_ip_header)) {
+		return;
+	}
+
+	ip = (struct damper_ip_header *)packet;
+	key->saddr = ip->ip_src.s_addr;
+	key->daddr = ip->ip_dst.s_addr;
+	key->proto = ip->ip_p;
+
+	ip_hdrlen = (ip->ip_vhl & 0x0f) * 4;
+
+	/* ports are only in first fragment */
+	if (((key->proto == TCP_PROTO_NUM) || (key->proto == UDP_PROTO_NUM))
+		&& ((ntohs(ip->ip_off) & IP_OFFMASK) == 0)
+		&& (packetlen >= ip_hdrlen + 4)) {
+
+		uint16_t *ports = (uint16_t *)(packet + ip_hdrlen);
+
+		key->sport = ntohs(ports[0]);
+		key->dport = ntohs(ports[1]);
+	}
+}
+
+void
+flow_key_mask(struct flow_key *key, int fkey, struct flow_key *res)
+{
+	memset(res, 0, sizeof(struct flow_key));
+
+	/* with conntrack info key is the original direction tuple, so both
+	directions of connection map to one flow. conntrack id distinguishes
+	connections that reused the same tuple */
+	if (fkey == FLOW_KEY_5TUPLE) {
+		res->ctid = key->ctid;
+	}
+
+	if (fkey & FLOW_KEY_SADDR) res->saddr = key->saddr;
+	if (fkey & FLOW_KEY_DADDR) res->daddr = key->daddr;
+	if (fkey & FLOW_KEY_PROTO) res->proto = key->proto;
+	if (fkey & FLOW_KEY_SPORT) res->sport = key->sport;
+	if (fkey & FLOW_KEY_DPORT) res->dport = key->dport;
+}
+
+uint32_t
+flow_hash(struct flow_key *k)
+{
+	uint32_t h;
+
+	if (k->ctid) {
+		/* conntrack id is unique already */
+		h = k->ctid;
+	} else {
+		h = k->saddr * 0x9e3779b1;
+		h ^= k->daddr + 0x7f4a7c15 + (h << 6) + (h >> 2);
+		h ^= (((uint32_t)k->sport << 16) | k->dport) + 0x7f4a7c15 + (h << 6) + (h >> 2);
+		h ^= k->proto;
+	}
+
+	/* murmur3 finalizer */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+int
+flowtab_init(struct userdata *u)
+{
+	size_t i, j, nmodules, nbuckets;
+
+	u->flowtabs = NULL;
+	u->nflowtabs = 0;
+
+	if (u->nflows == 0) {
+		u->nflows = FLOWS_DEF;
+	}
+
+	/* number of buckets is power of 2 */
+	nbuckets = 1;
+	while ((nbuckets * FLOW_WAYS < u->nflows) && (nbuckets * FLOW_WAYS < FLOWS_MAX)) {
+		nbuckets <<= 1;
+	}
+
+	for (nmodules=0; modules[nmodules].name; nmodules++)
+		;
+
+	/* there can't be more tables than modules */
+	u->flowtabs = calloc(nmodules + 1, sizeof(struct flowtab));
+	if (!u->flowtabs) {
+		fprintf(stderr, "calloc(%lu) failed\n", (long)(nmodules + 1) * sizeof(struct flowtab));
+		goto fail;
+	}
+
+	/* modules with the same key share one table */
+	for (i=0; i<nmodules; i++) {
+		struct flowtab *ft = NULL;
+
+		modules[i].ft = NULL;
+		if ((!modules[i].fkey) || (!modules[i].enabled)) {
+			continue;
+		}
+
+		for (j=0; j<u->nflowtabs; j++) {
+			if (u->flowtabs[j].fkey == modules[i].fkey) {
+				ft = &u->flowtabs[j];
+				break;
+			}
+		}
+
+		if (!ft) {
+			if (u->nflowtabs >= FLOWTAB_MAX) {
+				fprintf(stderr, "Too many flow tables, maximum is %d\n", FLOWTAB_MAX);
+				goto fail;
+			}
+			ft = &u->flowtabs[u->nflowtabs];
+			ft->fkey = modules[i].fkey;
+			ft->nbuckets = nbuckets;
+			ft->entsize = ALIGN8(sizeof(struct flow_entry));
+			u->nflowtabs++;
+		}
+
+		modules[i].ft = ft;
+		modules[i].foff = ft->entsize;
+		ft->entsize += ALIGN8(modules[i].fsize);
+	}
+
+	/* core needs 5-tuple flows for offload and weight cache */
+	u->coreft = NULL;
+	for (j=0; j<u->nflowtabs; j++) {
+		if (u->flowtabs[j].fkey == FLOW_KEY_5TUPLE) {
+			u->coreft = &u->flowtabs[j];
+		}
+	}
+	if (!u->coreft && (u->offload_bulk || u->wcache_packets || u->wcache_ms)) {
+		if (u->nflowtabs >= FLOWTAB_MAX) {
+			fprintf(stderr, "Too many flow tables, maximum is %d\n", FLOWTAB_MAX);
+			goto fail;
+		}
+		u->coreft = &u->flowtabs[u->nflowtabs];
+		u->coreft->fkey = FLOW_KEY_5TUPLE;
+		u->coreft->nbuckets = nbuckets;
+		u->coreft->entsize = ALIGN8(sizeof(struct flow_entry));
+		u->nflowtabs++;
+	}
+
+	/* all flow state is allocated at once */
+	for (j=0; j<u->nflowtabs; j++) {
+		struct flowtab *ft = &u->flowtabs[j];
+
+		ft->arena = calloc(ft->nbuckets * FLOW_WAYS, ft->entsize);
+		if (!ft->arena) {
+			fprintf(stderr, "calloc(%lu) failed for flow table\n",
+				(long)ft->nbuckets * FLOW_WAYS * ft->entsize);
+			goto fail;
+		}
+
+		ft->locks = malloc(ft->nbuckets * sizeof(pthread_mutex_t));
+		if (!ft->locks) {
+			fprintf(stderr, "malloc(%lu) failed\n", (long)ft->nbuckets * sizeof(pthread_mutex_t));
+			goto fail;
+		}
+		for (i=0; i<ft->nbuckets; i++) {
+			pthread_mutex_init(&ft->locks[i], NULL);
+		}
+	}
+
+	return 1;
+
+fail:
+	flowtab_destroy(u);
+	return 0;
+}
+
+void
+flowtab_destroy(struct userdata *u)
+{
+	size_t i, j;
+
+	for (j=0; j<u->nflowtabs; j++) {
+		struct flowtab *ft = &u->flowtabs[j];
+
+		if (ft->locks) {
+			for (i=0; i<ft->nbuckets; i++) {
+				pthread_mutex_destroy(&ft->locks[i]);
+			}
+			free(ft->locks);
+		}
+		free(ft->arena);
+	}
+
+	for (i=0; modules[i].name; i++) {
+		modules[i].ft = NULL;
+	}
+
+	free(u->flowtabs);
+	u->flowtabs = NULL;
+	u->nflowtabs = 0;
+	u->coreft = NULL;
+}
+
+static void
+flow_evict(struct flowtab *ft, struct flow_entry *fe)
+{
+	size_t i;
+
+	for (i=0; modules[i].name; i++) {
+		if ((modules[i].ft == ft) && modules[i].fevict) {
+			(modules[i].fevict)(modules[i].mptr, &fe->key, flow_state(fe, i));
+		}
+	}
+}
+
+struct flow_entry *
+flowtab_lookup(struct flowtab *ft, struct flow_key *key, uint32_t now)
+{
+	struct flow_key k;
+	struct flow_entry *fe, *victim = NULL;
+	size_t b, i;
+
+	flow_key_mask(key, ft->fkey, &k);
+	b = flow_hash(&k) & (ft->nbuckets - 1);
+
+	pthread_mutex_lock(&ft->locks[b]);
+
+	for (i=0; i<FLOW_WAYS; i++) {
+		fe = FLOW_ENTRY(ft, b * FLOW_WAYS + i);
+
+		if (!fe->used) {
+			if (!victim || victim->used) {
+				victim = fe;
+			}
+		} else if (memcmp(&fe->key, &k, sizeof(struct flow_key)) == 0) {
+			fe->last = now;
+			return fe;
+		} else if (!victim || (victim->used && (fe->last < victim->last))) {
+			victim = fe;
+		}
+	}
+
+	/* not found, replace free or least recently used entry */
+	if (victim->used) {
+		flow_evict(ft, victim);
+	}
+	memset(victim, 0, ft->entsize);
+	victim->key = k;
+	victim->used = 1;
+	victim->last = now;
+
+	return victim;
+}
+
+void
+flowtab_remove(struct flowtab *ft, struct flow_entry *fe)
+{
+	flow_evict(ft, fe);
+	memset(fe, 0, ft->entsize);
+}
+
+void
+flowtab_release(struct flowtab *ft, struct flow_entry *fe)
+{
+	size_t b;
+
+	b = ((unsigned char *)fe - ft->arena) / ft->entsize / FLOW_WAYS;
+	pthread_mutex_unlock(&ft->locks[b]);
+}
+
+void
+flow_foreach(size_t n, flow_iter_func cb, void *arg)
+{
+	struct flowtab *ft = modules[n].ft;
+	size_t b, i;
+
+	if (!ft) {
+		return;
+	}
+
+	for (b=0; b<ft->nbuckets; b++) {
+		pthread_mutex_lock(&ft->locks[b]);
+		for (i=0; i<FLOW_WAYS; i++) {
+			struct flow_entry *fe = FLOW_ENTRY(ft, b * FLOW_WAYS + i);
+
+			if (fe->used) {
+				cb(&fe->key, flow_state(fe, n), arg);
+			}
+		}
+		pthread_mutex_unlock(&ft->locks[b]);
+	}
+}
+
+
+/*
+ * snapshot of all flow tables: layout description followed by arenas.
+ * snapshot is loaded only if layout is the same (same modules, flow key and sizes)
+ */
+
+#define SNAP_MAGIC "DMPRFLOW"
+#define SNAP_VERSION 1
+
+struct snap_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t ntabs, nmods;
+	uint32_t pad;
+};
+
+struct snap_table
+{
+	uint32_t fkey;
+	uint32_t pad;
+	uint64_t nbuckets, entsize;
+};
+
+struct snap_module
+{
+	char name[32];
+	uint32_t fkey, fsize;
+	uint64_t foff;
+};
+
+/* layout of current tables, caller frees it */
+static unsigned char *
+snap_layout(struct userdata *u, size_t *len)
+{
+	struct snap_header *h;
+	struct snap_table *t;
+	struct snap_module *m;
+	size_t i, nmods = 0;
+	unsigned char *buf;
+
+	for (i=0; modules[i].name; i++) {
+		if (modules[i].ft) nmods++;
+	}
+
+	*len = sizeof(struct snap_header) + u->nflowtabs * sizeof(struct snap_table)
+		+ nmods * sizeof(struct snap_module);
+	buf = calloc(1, *len);
+	if (!buf) {
+		return NULL;
+	}
+
+	h = (struct snap_header *)buf;
+	memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+	h->version = SNAP_VERSION;
+	h->ntabs = u->nflowtabs;
+	h->nmods = nmods;
+
+	t = (struct snap_table *)(h + 1);
+	for (i=0; i<u->nflowtabs; i++, t++) {
+		t->fkey = u->flowtabs[i].fkey;
+		t->nbuckets = u->flowtabs[i].nbuckets;
+		t->entsize = u->flowtabs[i].entsize;
+	}
+
+	m = (struct snap_module *)t;
+	for (i=0; modules[i].name; i++) {
+		if (!modules[i].ft) continue;
+
+		strncpy(m->name, modules[i].name, sizeof(m->name) - 1);
+		m->fkey = modules[i].fkey;
+		m->fsize = modules[i].fsize;
+		m->foff = modules[i].foff;
+		m++;
+	}
+
+	return buf;
+}
+
+int
+flowtab_save(struct userdata *u, const char *path)
+{
+	char tmp[PATH_MAX];
+	unsigned char *layout;
+	size_t len, j;
+	FILE *f;
+
+	layout = snap_layout(u, &len);
+	if (!layout) {
+		fprintf(stderr, "Can't allocate memory for flow snapshot\n");
+		goto fail_layout;
+	}
+
+	/* write to temporary file, so old snapshot is kept if something fails */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		fprintf(stderr, "Can't create file '%s': %s\n", tmp, strerror(errno));
+		goto fail_open;
+	}
+
+	if (fwrite(layout, 1, len, f) != len) {
+		goto fail_write;
+	}
+	for (j=0; j<u->nflowtabs; j++) {
+		struct flowtab *ft = &u->flowtabs[j];
+		size_t size = ft->nbuckets * FLOW_WAYS * ft->entsize;
+
+		if (fwrite(ft->arena, 1, size, f) != size) {
+			goto fail_write;
+		}
+	}
+
+	if (fclose(f) != 0) {
+		goto fail_close;
+	}
+	if (rename(tmp, path) != 0) {
+		fprintf(stderr, "Can't rename '%s' to '%s': %s\n", tmp, path, strerror(errno));
+		goto fail_close;
+	}
+
+	free(layout);
+	return 1;
+
+fail_write:
+	fclose(f);
+fail_close:
+	fprintf(stderr, "Can't write flow snapshot '%s'\n", tmp);
+	unlink(tmp);
+fail_open:
+	free(layout);
+fail_layout:
+	return 0;
+}
+
+int
+flowtab_load(struct userdata *u, const char *path)
+{
+	unsigned char *layout, *map;
+	size_t len, size, off, j, i;
+	struct stat st;
+	int fd, r = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		/* first start, nothing to load */
+		return 0;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		goto fail_stat;
+	}
+
+	layout = snap_layout(u, &len);
+	if (!layout) {
+		goto fail_stat;
+	}
+
+	size = len;
+	for (j=0; j<u->nflowtabs; j++) {
+		size += u->flowtabs[j].nbuckets * FLOW_WAYS * u->flowtabs[j].entsize;
+	}
+	if ((size_t)st.st_size != size) {
+		fprintf(stderr, "Flow snapshot '%s' doesn't match current configuration, ignored\n", path);
+		goto fail_size;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap() of '%s' failed: %s\n", path, strerror(errno));
+		goto fail_size;
+	}
+
+	if (memcmp(map, layout, len) != 0) {
+		fprintf(stderr, "Flow snapshot '%s' doesn't match current configuration, ignored\n", path);
+		goto fail_layout;
+	}
+
+	off = len;
+	for (j=0; j<u->nflowtabs; j++) {
+		struct flowtab *ft = &u->flowtabs[j];
+		size_t tsize = ft->nbuckets * FLOW_WAYS * ft->entsize;
+
+		memcpy(ft->arena, map + off, tsize);
+		off += tsize;
+
+		for (i=0; i<ft->nbuckets * FLOW_WAYS; i++) {
+			struct flow_entry *fe = FLOW_ENTRY(ft, i);
+			size_t n;
+
+			if (!fe->used) continue;
+
+			/* cache time is monotonic clock of previous process */
+			fe->wc_left = 0;
+
+			for (n=0; modules[n].name; n++) {
+				if ((modules[n].ft == ft) && modules[n].frestore) {
+					(modules[n].frestore)(modules[n].mptr, &fe->key, flow_state(fe, n));
+				}
+			}
+		}
+	}
+	fprintf(stderr, "Flow state loaded from '%s'\n", path);
+	r = 1;
+
+fail_layout:
+	munmap(map, size);
+fail_size:
+	free(layout);
+fail_stat:
+	close(fd);
+	return r;
+}
+
@@ -0,0 +1,77 @@
+#ifndef flowtab_h_included
+#define flowtab_h_included
+
+#include "damper.h"
+
+#define FLOWS_DEF 4096   /* default number of flows in each table */
+#define FLOW_WAYS 4      /* entries in one bucket */
+#define FLOWS_MAX ((size_t)1 << 30) /* maximum number of flows in table */
+#define FLOWTAB_MAX 8    /* maximum number of distinct flow keys */
+
+/* flow entry header, module states follow it */
+struct flow_entry
+{
+	struct flow_key key;
+	uint32_t last;           /* last time flow was seen */
+	uint32_t used;
+
+	/* core state, valid in table u->coreft */
+	uint32_t packets;
+	float wavg, wdev;        /* average weight and its mean deviation */
+
+	/* cached sum of per-flow module weights */
+	double wcache;
+	uint32_t wc_left;        /* packets before refresh, 0 if cache is empty */
+	uint32_t wc_time;        /* when weight was computed, ms */
+	int wc_hints;
+};
+
+/* set-associative table of flows */
+struct flowtab
+{
+	int fkey;                /* key fields */
+	size_t nbuckets;         /* power of 2 */
+	size_t entsize;          /* header + states of all modules */
+
+	unsigned char *arena;
+	pthread_mutex_t *locks;  /* one lock for each bucket */
+};
+
+typedef void (*flow_iter_func)(struct flow_key *key, void *flow, void *arg);
+
+/* parse IP header and fill all key fields */
+void flow_key_parse(char *packet, int packetlen, struct flow_key *key);
+
+/* copy only 'fkey' fields of key */
+void flow_key_mask(struct flow_key *key, int fkey, struct flow_key *res);
+
+/* hash of key, also used to pick worker thread */
+uint32_t flow_hash(struct flow_key *key);
+
+/* create tables for registered modules */
+int flowtab_init(struct userdata *u);
+void flowtab_destroy(struct userdata *u);
+
+/* find or create flow, bucket is locked until flowtab_release() */
+struct flow_entry *flowtab_lookup(struct flowtab *ft, struct flow_key *key, uint32_t now);
+void flowtab_release(struct flowtab *ft, struct flow_entry *fe);
+
+/* free state of locked flow */
+void flowtab_remove(struct flowtab *ft, struct flow_entry *fe);
+
+/* flow state snapshot, for restart without losing flows */
+int flowtab_save(struct userdata *u, const char *path);
+int flowtab_load(struct userdata *u, const char *path);
+
+/* walk over all flows of module */
+void flow_foreach(size_t n, flow_iter_func cb, void *arg);
+
+/* module state in flow entry */
+static inline void *
+flow_state(struct flow_entry *fe, size_t n)
+{
+	return (unsigned char *)fe + modules[n].foff;
+}
+
+#endif
+
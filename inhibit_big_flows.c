@@ -1,25 +1,41 @@
-struct flow
+/* per-flow state, flow identified by pair of hosts */
+struct ibf_flow
 {
-	uint32_t saddr, daddr;
 	uint64_t octets;
-} __attribute__((packed));
+};
 
 struct inhibit_big_flows
 {
-	struct flow *recent_flows;
-	int nflows;
-	int currflow;
-	uint64_t flow_octets;
+	uint64_t flow_octets;   /* updated atomically, weights are computed in several threads */
 	size_t module_number;
 
 	int debug;
 	pthread_t debug_tid;
-	pthread_mutex_t lock;
 
 	char *statdir;
 	FILE *fdbg;
 };
 
+/* flow evicted from table, forget its octets */
+static void
+inhibit_big_flows_evict(void *arg, struct flow_key *key, void *flow)
+{
+	struct inhibit_big_flows *data = arg;
+	struct ibf_flow *f = flow;
+
+	__sync_sub_and_fetch(&data->flow_octets, f->octets);
+}
+
+/* flow loaded from snapshot, count its octets */
+static void
+inhibit_big_flows_restore(void *arg, struct flow_key *key, void *flow)
+{
+	struct inhibit_big_flows *data = arg;
+	struct ibf_flow *f = flow;
+
+	data->flow_octets += f->octets;
+}
+
 void *
 inhibit_big_flows_init(struct userdata *u, size_t n)
 {
@@ -33,14 +49,14 @@ inhibit_big_flows_init(struct userdata *u, size_t n)
 		goto fail_alloc;
 	}
 
-	data->nflows = 0;
-	data->currflow = 0;
 	data->flow_octets = 0;
 
 	data->debug = 0;
 	data->module_number = n;
 	data->statdir = u->statdir;
-	pthread_mutex_init(&data->lock, NULL);
+
+	flow_register(n, FLOW_KEY_HOSTS, sizeof(struct ibf_flow), &inhibit_big_flows_evict);
+	modules[n].frestore = &inhibit_big_flows_restore;
 
 	return data;
 
@@ -54,7 +70,8 @@ inhibit_big_flows_conf(void *arg, char *param1, char *param2)
 	struct inhibit_big_flows *data = arg;
 
 	if (!strcmp(param1, "nrecent")) {
-		data->nflows = atoi(param2);
+		fprintf(stderr, "Module %s: 'nrecent' is obsolete, number of flows is set by 'flows'\n",
+			modules[data->module_number].name);
 	} else if (!strcmp(param1, "debug")) {
 		data->debug = atoi(param2);
 		if (data->debug <= 0) {
@@ -69,27 +86,30 @@ inhibit_big_flows_conf(void *arg, char *param1, char *param2)
 	}
 }
 
+static void
+inhibit_big_flows_debug_flow(struct flow_key *key, void *flow, void *arg)
+{
+	struct inhibit_big_flows *data = arg;
+	struct ibf_flow *f = flow;
+	struct in_addr saddr, daddr;
+
+	saddr.s_addr = key->saddr;
+	daddr.s_addr = key->daddr;
+	fprintf(data->fdbg, "[%s => ", inet_ntoa(saddr));
+	fprintf(data->fdbg, "%s] %lu\n", inet_ntoa(daddr), (long)f->octets);
+}
+
 void *
 inhibit_big_flows_debug(void *arg)
 {
 	struct inhibit_big_flows *data = arg;
-	int i;
 
 	for (;;) {
 		sleep(data->debug);
-		pthread_mutex_lock(&data->lock);
 
 		fprintf(data->fdbg, "total: %lu\n", (long)data->flow_octets);
-		for (i=0; i<data->nflows; i++) {
-			struct in_addr saddr, daddr;
 
-			saddr.s_addr = data->recent_flows[i].saddr;
-			daddr.s_addr = data->recent_flows[i].daddr;
-			fprintf(data->fdbg, "%d: [%s => ", i, inet_ntoa(saddr));
-			fprintf(data->fdbg, "%s] %lu\n", inet_ntoa(daddr), (long)data->recent_flows[i].octets);
-		}
-
-		pthread_mutex_unlock(&data->lock);
+		flow_foreach(data->module_number, &inhibit_big_flows_debug_flow, data);
 
 		fprintf(data->fdbg, "\n\n");
 		fflush(data->fdbg);
@@ -102,21 +122,6 @@ inhibit_big_flows_postconf(void *arg)
 {
 	struct inhibit_big_flows *data = arg;
 
-	if (data->nflows < 1) {
-		fprintf(stderr, "Module %s: incorrect value %d for number of recent flows\n",
-			modules[data->module_number].name, data->nflows);
-		goto fail;
-	}
-
-	/* create array of recent flows */
-	data->recent_flows = malloc(data->nflows * sizeof(struct flow));
-	if (!data->recent_flows) {
-		fprintf(stderr, "Module %s: malloc() failed for %d recent flows\n",
-			modules[data->module_number].name, data->nflows);
-		goto fail;
-	}
-	memset(data->recent_flows, 0, data->nflows * sizeof(struct flow));
-
 	if (data->debug) {
 		char debugfile[PATH_MAX];
 
@@ -144,65 +149,28 @@ inhibit_big_flows_free(void *arg)
 	if (data->debug) {
 		fclose(data->fdbg);
 	}
-	free(data->recent_flows);
 	free(data);
 }
 
 double
-inhibit_big_flows_weight(void *arg, char *packet, int packetlen, int mark)
+inhibit_big_flows_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
 {
 	double m;
-	unsigned int i;
-	uint32_t saddr, daddr;
-	struct damper_ip_header *ip;
-	int found = 0;
+	struct ibf_flow *f = flow;
 	struct inhibit_big_flows *data = arg;
+	uint64_t total;
 
-	ip = (struct damper_ip_header *)packet;
-	saddr = ip->ip_src.s_addr;
-	daddr = ip->ip_dst.s_addr;
-
-	if (data->debug) {
-		pthread_mutex_lock(&data->lock);
-	}
-
-	for (i=0; i<data->nflows; i++) {
-		if ((saddr == data->recent_flows[i].saddr) && (daddr == data->recent_flows[i].daddr)) {
-			data->recent_flows[i].octets += packetlen;
-			found = 1;
-			break;
-		}
-	}
-
-	if (!found) {
-		i = data->currflow;
+	/* flow state is protected by flow table, total is shared */
+	f->octets += packetlen;
+	total = __sync_add_and_fetch(&data->flow_octets, packetlen);
 
-		data->flow_octets -= data->recent_flows[i].octets;
-
-		data->recent_flows[i].saddr = saddr;
-		data->recent_flows[i].daddr = daddr;
-		data->recent_flows[i].octets = packetlen;
-
-		data->currflow++;
-		if (data->currflow >= data->nflows) {
-			data->currflow = 0;
-		}
-	}
-
-	data->flow_octets += packetlen;
-
-	if (data->recent_flows[i].octets > 0) {
-		m = (double)data->flow_octets / data->recent_flows[i].octets;
+	if (f->octets > 0) {
+		m = (double)total / f->octets;
 	} else {
 		/* something greater than 0 */
 		m = DBL_EPSILON;
 	}
 
-	if (data->debug) {
-		pthread_mutex_unlock(&data->lock);
-	}
-
 	return m;
 }
 
-
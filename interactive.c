@@ -0,0 +1,184 @@
+/*
+ * latency-sensitive packets: TCP handshakes, pure ACKs, DNS, NTP and small packets
+ */
+
+void interactive_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w);
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+
+#define INTERACTIVE_DEF_SMALL  128     /* packets up to this size are small */
+
+struct interactive
+{
+	size_t module_number;
+
+	double syn, ack, dns, ntp, small;   /* weights, 0 if class is not used */
+	int smallsize;
+	int accept;                         /* accept interactive packets without queueing */
+	int final;                          /* skip remaining modules for interactive packets */
+};
+
+void *
+interactive_init(struct userdata *u, size_t n)
+{
+	struct interactive *data;
+
+	data = malloc(sizeof(struct interactive));
+	if (!data) {
+		fprintf(stderr, "Module %s: malloc(%lu) failed\n",
+			modules[n].name, (long)sizeof(struct interactive));
+		goto fail_alloc;
+	}
+
+	data->module_number = n;
+	/* module is off until some weight is set in config */
+	data->syn = data->ack = data->dns = data->ntp = data->small = 0.0f;
+	data->smallsize = INTERACTIVE_DEF_SMALL;
+	data->accept = 0;
+	data->final = 0;
+	modules[n].perpacket = 1;
+	modules[n].weight_batch = &interactive_weight_batch;
+
+	return data;
+
+fail_alloc:
+	return NULL;
+}
+
+void
+interactive_conf(void *arg, char *param1, char *param2)
+{
+	struct interactive *data = arg;
+
+	if (!strcmp(param1, "syn")) {
+		data->syn = atof(param2);
+	} else if (!strcmp(param1, "ack")) {
+		data->ack = atof(param2);
+	} else if (!strcmp(param1, "dns")) {
+		data->dns = atof(param2);
+	} else if (!strcmp(param1, "ntp")) {
+		data->ntp = atof(param2);
+	} else if (!strcmp(param1, "small")) {
+		data->small = atof(param2);
+	} else if (!strcmp(param1, "smallsize")) {
+		data->smallsize = atoi(param2);
+	} else if (!strcmp(param1, "accept")) {
+		data->accept = !strcmp(param2, "yes");
+	} else if (!strcmp(param1, "final")) {
+		data->final = !strcmp(param2, "yes");
+	} else {
+		fprintf(stderr, "Module %s: unknown config parameter '%s'\n",
+			modules[data->module_number].name, param1);
+	}
+}
+
+int
+interactive_postconf(void *arg)
+{
+	struct interactive *data = arg;
+
+	if ((data->syn <= 0.0f) && (data->ack <= 0.0f) && (data->dns <= 0.0f)
+		&& (data->ntp <= 0.0f) && (data->small <= 0.0f)) {
+		/* no class has weight */
+		return MODULE_UNUSED;
+	}
+
+	return 1;
+}
+
+void
+interactive_free(void *arg)
+{
+	struct interactive *data = arg;
+
+	free(data);
+}
+
+static double
+interactive_class(struct interactive *data, char *packet, int packetlen)
+{
+	struct damper_ip_header *ip;
+	int ip_hdrlen;
+	unsigned char *l4;
+
+	ip = (struct damper_ip_header *)packet;
+	if ((packetlen < (int)sizeof(struct damper_ip_header)) || ((ip->ip_vhl >> 4) != 4)) {
+		/* truncated or not IPv4 */
+		return 0.0f;
+	}
+	ip_hdrlen = (ip->ip_vhl & 0x0f) * 4;
+	l4 = (unsigned char *)packet + ip_hdrlen;
+
+	/* non-first fragments have no transport header */
+	if (ntohs(ip->ip_off) & IP_OFFMASK) {
+		goto size;
+	}
+
+	if ((ip->ip_p == TCP_PROTO_NUM) && (packetlen >= ip_hdrlen + 20)) {
+		int tcp_hdrlen = (l4[12] >> 4) * 4;
+		int flags = l4[13];
+
+		if (flags & TCP_SYN) {
+			return data->syn;
+		}
+		/* pure ACK, without payload */
+		if (((flags & (TCP_ACK | TCP_FIN | TCP_RST)) == TCP_ACK)
+			&& (packetlen - ip_hdrlen - tcp_hdrlen <= 0)) {
+
+			return data->ack;
+		}
+	} else if ((ip->ip_p == UDP_PROTO_NUM) && (packetlen >= ip_hdrlen + 8)) {
+		int sport = (l4[0] << 8) | l4[1];
+		int dport = (l4[2] << 8) | l4[3];
+
+		if ((sport == 53) || (dport == 53)) {
+			return data->dns;
+		}
+		if ((sport == 123) || (dport == 123)) {
+			return data->ntp;
+		}
+	}
+
+size:
+	if (packetlen <= data->smallsize) {
+		return data->small;
+	}
+
+	return 0.0f;
+}
+
+double
+interactive_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
+{
+	struct interactive *data = arg;
+	double m;
+
+	m = interactive_class(data, packet, packetlen);
+	if (m <= 0.0f) {
+		/* something greater than 0 */
+		return DBL_EPSILON;
+	}
+
+	if (data->accept) {
+		*hints |= HINT_ACCEPT;
+	}
+	if (data->final) {
+		*hints |= HINT_FINAL;
+	}
+
+	return m;
+}
+
+void
+interactive_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w)
+{
+	size_t j;
+
+	for (j=0; j<n; j++) {
+		w[j] = interactive_weight(arg, d[j].packet, d[j].packetlen, d[j].mark, NULL, &d[j].hints);
+	}
+}
+
@@ -1,27 +1,26 @@
 #include "damper.h"
+#include "flowtab.h"
+#include "pipeline.h"
 
 #include "inhibit_big_flows.c"
 #include "bymark.c"
 #include "entropy.c"
 #include "random.c"
+#include "prefix.c"
+#include "interactive.c"
+#include "signature.c"
 
 struct module_info modules[] = {
-	{
-		"inhibit_big_flows",		/* module name */
-		&inhibit_big_flows_init,	/* constructor */
-		&inhibit_big_flows_conf,	/* configuration parameters */
-		&inhibit_big_flows_postconf,	/* when configuration done */
-		&inhibit_big_flows_weight,	/* weight calculation */
-		&inhibit_big_flows_free		/* destructor */
-	},
+	/* modules without flow state and with batch function go first,
+	   they are called once for whole batch of packets */
 #if 1
 	{
-		"random",
-		&random_init,
-		&random_conf,
-		&random_postconf,
-		&random_weight,
-		&random_free
+		"random",		/* module name */
+		&random_init,		/* constructor */
+		&random_conf,		/* configuration parameters */
+		&random_postconf,	/* when configuration done */
+		&random_weight,		/* weight calculation */
+		&random_free		/* destructor */
 	},
 	{
 		"bymark",
@@ -31,6 +30,41 @@ struct module_info modules[] = {
 		&bymark_weight,
 		&bymark_free
 	},
+	{
+		"prefix",
+		&prefix_init,
+		&prefix_conf,
+		&prefix_postconf,
+		&prefix_weight,
+		&prefix_free
+	},
+#endif
+	{
+		"inhibit_big_flows",
+		&inhibit_big_flows_init,
+		&inhibit_big_flows_conf,
+		&inhibit_big_flows_postconf,
+		&inhibit_big_flows_weight,
+		&inhibit_big_flows_free
+	},
+#if 1
+	{
+		"interactive",
+		&interactive_init,
+		&interactive_conf,
+		&interactive_postconf,
+		&interactive_weight,
+		&interactive_free
+	},
+	{
+		"signature",
+		&signature_init,
+		&signature_conf,
+		&signature_postconf,
+		&signature_weight,
+		&signature_free
+	},
+	/* most expensive module is the last one, it is skipped when other module sets HINT_FINAL */
 	{
 		"entropy",
 		&entropy_init,
@@ -42,3 +76,120 @@ struct module_info modules[] = {
 #endif
 	{NULL}
 };
+
+#ifdef DAMPER_STATIC_PIPELINE
+/*
+ * weight pipeline with direct calls, build with -DDAMPER_STATIC_PIPELINE.
+ * list must follow modules[] above, checked at startup.
+ * coefficient can be fixed at compile time, for example -DSTATIC_K_random=0.5,
+ * otherwise 'k' from config is used. module can be left out of pipeline at
+ * compile time with -DSTATIC_OFF_<name>, then it costs nothing per packet and
+ * is disabled at startup
+ */
+#define STATIC_MODULES(X) \
+	X(0, random) \
+	X(1, bymark) \
+	X(2, prefix) \
+	X(3, inhibit_big_flows) \
+	X(4, interactive) \
+	X(5, signature) \
+	X(6, entropy)
+
+#ifndef STATIC_K_random
+#define STATIC_K_random modules[0].k
+#endif
+#ifndef STATIC_K_bymark
+#define STATIC_K_bymark modules[1].k
+#endif
+#ifndef STATIC_K_prefix
+#define STATIC_K_prefix modules[2].k
+#endif
+#ifndef STATIC_K_inhibit_big_flows
+#define STATIC_K_inhibit_big_flows modules[3].k
+#endif
+#ifndef STATIC_K_interactive
+#define STATIC_K_interactive modules[4].k
+#endif
+#ifndef STATIC_K_signature
+#define STATIC_K_signature modules[5].k
+#endif
+#ifndef STATIC_K_entropy
+#define STATIC_K_entropy modules[6].k
+#endif
+
+#ifdef STATIC_OFF_random
+#define STATIC_ON_random 0
+#else
+#define STATIC_ON_random 1
+#endif
+#ifdef STATIC_OFF_bymark
+#define STATIC_ON_bymark 0
+#else
+#define STATIC_ON_bymark 1
+#endif
+#ifdef STATIC_OFF_prefix
+#define STATIC_ON_prefix 0
+#else
+#define STATIC_ON_prefix 1
+#endif
+#ifdef STATIC_OFF_inhibit_big_flows
+#define STATIC_ON_inhibit_big_flows 0
+#else
+#define STATIC_ON_inhibit_big_flows 1
+#endif
+#ifdef STATIC_OFF_interactive
+#define STATIC_ON_interactive 0
+#else
+#define STATIC_ON_interactive 1
+#endif
+#ifdef STATIC_OFF_signature
+#define STATIC_ON_signature 0
+#else
+#define STATIC_ON_signature 1
+#endif
+#ifdef STATIC_OFF_entropy
+#define STATIC_ON_entropy 0
+#else
+#define STATIC_ON_entropy 1
+#endif
+
+void
+modules_weigh(struct weigh_ctx *c)
+{
+#define STATIC_STEP(n, name) \
+	if (STATIC_ON_##name && !weigh_step(c, n, &name##_weight, STATIC_K_##name)) return;
+
+	STATIC_MODULES(STATIC_STEP)
+#undef STATIC_STEP
+}
+
+int
+modules_static_check(void)
+{
+	size_t n = 0;
+
+#define STATIC_CHECK(i, name) \
+	if (modules[i].weight != &name##_weight) return 0; \
+	n++;
+
+	STATIC_MODULES(STATIC_CHECK)
+#undef STATIC_CHECK
+
+	/* all modules must be in the list */
+	return modules[n].name == NULL;
+}
+
+void
+modules_static_disable(void)
+{
+#define STATIC_DISABLE(i, name) \
+	if (!STATIC_ON_##name && modules[i].enabled) { \
+		fprintf(stderr, "Module '%s': left out of static pipeline, disabled\n", #name); \
+		modules[i].enabled = 0; \
+	}
+
+	STATIC_MODULES(STATIC_DISABLE)
+#undef STATIC_DISABLE
+}
+#endif
+
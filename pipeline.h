@@ -0,0 +1,94 @@
+#ifndef pipeline_h_included
+#define pipeline_h_included
+
+#include "damper.h"
+#include "flowtab.h"
+
+/* weight calculation for one packet */
+struct weigh_ctx
+{
+	struct userdata *u;
+	struct flow_entry **fe;     /* flow of packet in each table */
+	char *packet;
+	int packetlen;
+	uint32_t mark;
+	int cached;                 /* flow weight is cached, only per-packet modules are called */
+	int complete;               /* no module was skipped, fweight can be cached */
+	size_t first;               /* modules before it were called for whole batch */
+
+	double weight;
+	int hints;
+	double fweight;             /* sum of per-flow weights */
+	int fhints;
+};
+
+/* batch function is used only by modules without flow state */
+static inline int
+module_batched(size_t n)
+{
+	return modules[n].weight_batch && !modules[n].fkey;
+}
+
+/* call weight function of module n, returns 0 if remaining modules are skipped.
+   generic loop passes modules[n].weight, static pipeline passes function itself,
+   so compiler can inline it */
+static inline __attribute__((always_inline)) int
+weigh_step(struct weigh_ctx *c, size_t n, module_weight_func weight, double k)
+{
+	struct module_info *m = &modules[n];
+	void *flow = NULL;
+	double mweight;
+	int mhints = 0;
+
+	if ((c->weight < 0.0) || (c->hints & (HINT_ACCEPT | HINT_FINAL))) {
+		/* module decided, remaining modules are not called. if it was
+		   per-packet module, per-flow weight is partial and can't be cached */
+		if (!(c->fhints & (HINT_ACCEPT | HINT_FINAL))) {
+			c->complete = 0;
+		}
+		return 0;
+	}
+	if ((!m->enabled) || (n < c->first) || (c->cached && !m->perpacket)) {
+		/* disabled, called already for whole batch, or flow weight is cached */
+		return 1;
+	}
+
+	if (m->ft) {
+		flow = flow_state(c->fe[m->ft - c->u->flowtabs], n);
+	}
+	mweight = weight(m->mptr, c->packet, c->packetlen, c->mark, flow, &mhints);
+	c->hints |= mhints;
+
+	if (mweight < 0.0) {
+		c->weight = mweight;
+		return 0;
+	}
+	mweight *= k;
+
+	if (!m->perpacket) {
+		c->fweight += mweight;
+		c->fhints |= mhints;
+	}
+
+	if (c->u->wchart) {
+		__sync_fetch_and_add(&m->whist[stat_whist_bucket(mweight)], 1);
+	}
+
+	c->weight += mweight;
+
+	return 1;
+}
+
+#ifdef DAMPER_STATIC_PIPELINE
+/* modules[] with direct calls, generated in modules.conf.c */
+void modules_weigh(struct weigh_ctx *c);
+
+/* check that static pipeline matches modules[] */
+int modules_static_check(void);
+
+/* disable modules left out of static pipeline with -DSTATIC_OFF_<name> */
+void modules_static_disable(void);
+#endif
+
+#endif
+
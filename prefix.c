@@ -0,0 +1,346 @@
+/*
+ * weight by source/destination subnet
+ * longest prefix match with DIR-24-8 tables: first 24 bits of address index tbl24,
+ * longer prefixes are expanded to groups of 256 entries in tbl8
+ */
+
+void prefix_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w);
+
+#define PREFIX_EXT     0x8000   /* tbl24 entry points to tbl8 group */
+#define PREFIX_MAXIDX  0x7fff   /* maximum number of distinct weights */
+
+#define PREFIX_SRC 0x01
+#define PREFIX_DST 0x02
+
+struct prefix_rule
+{
+	uint32_t addr;      /* host byte order */
+	int len;
+	double w;
+};
+
+struct prefix
+{
+	size_t module_number;
+
+	char file[PATH_MAX];
+	int addr;           /* which addresses are looked up */
+
+	/* lookup tables, entry is index of weight + 1, 0 if no match */
+	uint16_t *tbl24;
+	uint16_t *tbl8;
+	size_t ntbl8, tbl8_alloc;   /* groups of 256 entries */
+
+	double *weights;
+	size_t nweights;
+};
+
+void *
+prefix_init(struct userdata *u, size_t n)
+{
+	struct prefix *data;
+
+	data = malloc(sizeof(struct prefix));
+	if (!data) {
+		fprintf(stderr, "Module %s: malloc(%lu) failed\n",
+			modules[n].name, (long)sizeof(struct prefix));
+		goto fail_alloc;
+	}
+
+	data->module_number = n;
+	data->file[0] = '\0';
+	data->addr = PREFIX_DST;
+
+	data->tbl24 = NULL;
+	data->tbl8 = NULL;
+	data->ntbl8 = data->tbl8_alloc = 0;
+	data->weights = NULL;
+	data->nweights = 0;
+
+	modules[n].weight_batch = &prefix_weight_batch;
+
+	return data;
+
+fail_alloc:
+	return NULL;
+}
+
+void
+prefix_conf(void *arg, char *param1, char *param2)
+{
+	struct prefix *data = arg;
+
+	if (!strcmp(param1, "file")) {
+		strncpy(data->file, param2, PATH_MAX - 1);
+		data->file[PATH_MAX - 1] = '\0';
+	} else if (!strcmp(param1, "addr")) {
+		if (!strcmp(param2, "src")) {
+			data->addr = PREFIX_SRC;
+		} else if (!strcmp(param2, "dst")) {
+			data->addr = PREFIX_DST;
+		} else if (!strcmp(param2, "both")) {
+			data->addr = PREFIX_SRC | PREFIX_DST;
+		} else {
+			fprintf(stderr, "Module %s: unknown address '%s', use src, dst or both\n",
+				modules[data->module_number].name, param2);
+		}
+	} else {
+		fprintf(stderr, "Module %s: unknown config parameter '%s'\n",
+			modules[data->module_number].name, param1);
+	}
+}
+
+/* index of weight + 1, the same weights share index */
+static uint16_t
+prefix_weight_idx(struct prefix *data, double w)
+{
+	size_t i;
+
+	for (i=0; i<data->nweights; i++) {
+		if (data->weights[i] == w) {
+			return i + 1;
+		}
+	}
+
+	if (data->nweights >= PREFIX_MAXIDX) {
+		return 0;
+	}
+
+	if ((data->nweights & (data->nweights - 1)) == 0) {
+		/* power of 2, grow array */
+		double *tmp = realloc(data->weights, sizeof(double) * (data->nweights ? data->nweights * 2 : 16));
+
+		if (!tmp) {
+			return 0;
+		}
+		data->weights = tmp;
+	}
+	data->weights[data->nweights] = w;
+	data->nweights++;
+
+	return data->nweights;
+}
+
+static int
+prefix_add(struct prefix *data, struct prefix_rule *r)
+{
+	uint16_t idx;
+	uint32_t first, last, i;
+
+	idx = prefix_weight_idx(data, r->w);
+	if (!idx) {
+		return 0;
+	}
+
+	first = r->addr;
+	last = (r->len == 32) ? first : (first | (UINT32_MAX >> r->len));
+
+	if (r->len <= 24) {
+		/* shorter prefixes are added first, so there are no tbl8 groups in range yet */
+		for (i=(first >> 8); i<=(last >> 8); i++) {
+			data->tbl24[i] = idx;
+		}
+		return 1;
+	}
+
+	/* expand tbl24 entry to tbl8 group */
+	if (!(data->tbl24[first >> 8] & PREFIX_EXT)) {
+		uint16_t old = data->tbl24[first >> 8];
+		size_t g;
+
+		if (data->ntbl8 >= PREFIX_MAXIDX) {
+			return 0;
+		}
+		if (data->ntbl8 == data->tbl8_alloc) {
+			size_t nalloc = data->tbl8_alloc ? data->tbl8_alloc * 2 : 64;
+			uint16_t *tmp = realloc(data->tbl8, nalloc * 256 * sizeof(uint16_t));
+
+			if (!tmp) {
+				return 0;
+			}
+			data->tbl8 = tmp;
+			data->tbl8_alloc = nalloc;
+		}
+		g = data->ntbl8++;
+		for (i=0; i<256; i++) {
+			data->tbl8[g * 256 + i] = old;
+		}
+		data->tbl24[first >> 8] = PREFIX_EXT | g;
+	}
+
+	for (i=(first & 0xff); i<=(last & 0xff); i++) {
+		data->tbl8[(data->tbl24[first >> 8] & ~PREFIX_EXT) * 256 + i] = idx;
+	}
+
+	return 1;
+}
+
+static int
+prefix_rule_cmp(const void *a, const void *b)
+{
+	const struct prefix_rule *ra = a, *rb = b;
+
+	return ra->len - rb->len;
+}
+
+/* read file with lines "a.b.c.d/len weight" */
+static int
+prefix_load(struct prefix *data)
+{
+	FILE *f;
+	char line[LINE_MAX];
+	struct prefix_rule *rules = NULL;
+	size_t nrules = 0, rules_alloc = 0, i;
+	int lineno = 0;
+
+	f = fopen(data->file, "r");
+	if (!f) {
+		fprintf(stderr, "Module %s: can't open file '%s'\n",
+			modules[data->module_number].name, data->file);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char addr[LINE_MAX];
+		struct in_addr a;
+		struct prefix_rule r;
+		char *slash;
+
+		lineno++;
+		if (sscanf(line, "%s %lf", addr, &r.w) != 2) {
+			continue;
+		}
+		if (addr[0] == '#') {
+			continue;
+		}
+
+		r.len = 32;
+		slash = strchr(addr, '/');
+		if (slash) {
+			*slash = '\0';
+			r.len = atoi(slash + 1);
+		}
+
+		if ((inet_pton(AF_INET, addr, &a) != 1) || (r.len < 0) || (r.len > 32)) {
+			fprintf(stderr, "Module %s: %s:%d: incorrect prefix\n",
+				modules[data->module_number].name, data->file, lineno);
+			continue;
+		}
+		r.addr = ntohl(a.s_addr);
+		if (r.len < 32) {
+			r.addr &= ~(UINT32_MAX >> r.len);
+		}
+
+		if (nrules == rules_alloc) {
+			struct prefix_rule *tmp;
+
+			rules_alloc = rules_alloc ? rules_alloc * 2 : 1024;
+			tmp = realloc(rules, rules_alloc * sizeof(struct prefix_rule));
+			if (!tmp) {
+				fprintf(stderr, "Module %s: realloc() failed\n", modules[data->module_number].name);
+				goto fail;
+			}
+			rules = tmp;
+		}
+		rules[nrules++] = r;
+	}
+
+	/* longer prefixes overwrite shorter ones */
+	qsort(rules, nrules, sizeof(struct prefix_rule), &prefix_rule_cmp);
+
+	for (i=0; i<nrules; i++) {
+		if (!prefix_add(data, &rules[i])) {
+			fprintf(stderr, "Module %s: can't add prefix, too many distinct weights or long prefixes\n",
+				modules[data->module_number].name);
+			goto fail;
+		}
+	}
+
+	fprintf(stderr, "Module %s: %lu prefixes loaded\n", modules[data->module_number].name, (long)nrules);
+
+	free(rules);
+	fclose(f);
+	return 1;
+
+fail:
+	free(rules);
+	fclose(f);
+	return 0;
+}
+
+int
+prefix_postconf(void *arg)
+{
+	struct prefix *data = arg;
+
+	if (data->file[0] == '\0') {
+		/* module is not used */
+		return MODULE_UNUSED;
+	}
+
+	data->tbl24 = calloc(1 << 24, sizeof(uint16_t));
+	if (!data->tbl24) {
+		fprintf(stderr, "Module %s: calloc() failed\n", modules[data->module_number].name);
+		return 0;
+	}
+
+	return prefix_load(data);
+}
+
+void
+prefix_free(void *arg)
+{
+	struct prefix *data = arg;
+
+	free(data->tbl24);
+	free(data->tbl8);
+	free(data->weights);
+	free(data);
+}
+
+static inline uint16_t
+prefix_lookup(struct prefix *data, uint32_t addr)
+{
+	uint16_t e;
+
+	e = data->tbl24[addr >> 8];
+	if (e & PREFIX_EXT) {
+		e = data->tbl8[(e & ~PREFIX_EXT) * 256 + (addr & 0xff)];
+	}
+
+	return e;
+}
+
+double
+prefix_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
+{
+	struct prefix *data = arg;
+	struct damper_ip_header *ip;
+	uint16_t e = 0;
+
+	ip = (struct damper_ip_header *)packet;
+	if ((packetlen < (int)sizeof(struct damper_ip_header)) || ((ip->ip_vhl >> 4) != 4)) {
+		/* truncated or not IPv4, addresses are unknown */
+		return DBL_EPSILON;
+	}
+
+	if (data->addr & PREFIX_DST) {
+		e = prefix_lookup(data, ntohl(ip->ip_dst.s_addr));
+	}
+	if (!e && (data->addr & PREFIX_SRC)) {
+		e = prefix_lookup(data, ntohl(ip->ip_src.s_addr));
+	}
+
+	return e ? data->weights[e - 1] : DBL_EPSILON;
+}
+
+void
+prefix_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w)
+{
+	size_t j;
+
+	for (j=0; j<n; j++) {
+		w[j] = prefix_weight(arg, d[j].packet, d[j].packetlen, d[j].mark, NULL, &d[j].hints);
+	}
+}
+
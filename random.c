@@ -1,8 +1,75 @@
+
+void random_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w);
+
+#define RANDOM_BATCH 256 /* weights generated at once */
+
 struct mod_random
 {
 	size_t module_number;
+
+	uint64_t seed;
+	uint64_t nthreads;  /* number of threads with own generator */
+};
+
+/* per-thread generator (xoshiro256+) and pre-generated weights */
+struct random_state
+{
+	int init;
+	uint64_t s[4];
+
+	size_t pos;
+	double w[RANDOM_BATCH];
 };
 
+static __thread struct random_state random_tls;
+
+/* used to expand seed */
+static uint64_t
+random_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t
+random_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t
+random_next(uint64_t *s)
+{
+	uint64_t result = s[0] + s[3];
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = random_rotl(s[3], 45);
+
+	return result;
+}
+
+/* fill batch of weights, same distribution as (RAND_MAX + 1) / (rand() + 1) */
+static void
+random_fill(struct random_state *r)
+{
+	size_t i;
+
+	for (i=0; i<RANDOM_BATCH; i++) {
+		uint64_t x = random_next(r->s);
+
+		r->w[i] = 9007199254740992.0 / (double)((x >> 11) + 1); /* 2^53 / (0..2^53-1 + 1) */
+	}
+	r->pos = 0;
+}
+
 void *
 random_init(struct userdata *u, size_t n)
 {
@@ -16,6 +83,10 @@ random_init(struct userdata *u, size_t n)
 	}
 
 	data->module_number = n;
+	data->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	data->nthreads = 0;
+	modules[n].perpacket = 1;
+	modules[n].weight_batch = &random_weight_batch;
 
 	return data;
 
@@ -26,6 +97,15 @@ fail_alloc:
 void
 random_conf(void *arg, char *param1, char *param2)
 {
+	struct mod_random *data = arg;
+
+	if (!strcmp(param1, "seed")) {
+		/* fixed seed, for reproducible results */
+		data->seed = strtoull(param2, NULL, 0);
+	} else {
+		fprintf(stderr, "Module %s: unknown config parameter '%s'\n",
+			modules[data->module_number].name, param1);
+	}
 }
 
 
@@ -43,13 +123,58 @@ random_free(void *arg)
 	free(data);
 }
 
+static inline struct random_state *
+random_state_get(struct mod_random *data)
+{
+	struct random_state *r = &random_tls;
+
+	if (!r->init) {
+		/* each thread gets its own sequence */
+		uint64_t x, i;
+
+		x = data->seed + __sync_fetch_and_add(&data->nthreads, 1) * 0x2545f4914f6cdd1dULL;
+		for (i=0; i<4; i++) {
+			r->s[i] = random_splitmix64(&x);
+		}
+		random_fill(r);
+		r->init = 1;
+	}
+
+	return r;
+}
+
 double
-random_weight(void *arg, char *packet, int packetlen, int mark)
+random_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
 {
-	double m;
+	struct random_state *r = random_state_get(arg);
 
-	m = ((double)RAND_MAX + 1) / (rand() + 1);
+	if (r->pos >= RANDOM_BATCH) {
+		random_fill(r);
+	}
+
+	return r->w[r->pos++];
+}
 
-	return m;
+/* copy pre-generated weights */
+void
+random_weight_batch(void *arg, struct weight_desc *d, size_t n, double *w)
+{
+	struct random_state *r = random_state_get(arg);
+	size_t j = 0;
+
+	while (j < n) {
+		size_t k = RANDOM_BATCH - r->pos;
+
+		if (k == 0) {
+			random_fill(r);
+			continue;
+		}
+		if (k > n - j) {
+			k = n - j;
+		}
+		memcpy(&w[j], &r->w[r->pos], k * sizeof(double));
+		r->pos += k;
+		j += k;
+	}
 }
 
@@ -0,0 +1,426 @@
+/*
+ * protocol classification by payload signatures
+ * all patterns are matched at once with Aho-Corasick automaton, only first
+ * packets of flow are inspected, result is cached in flow state
+ */
+
+#define SIG_DEF_PACKETS 4   /* packets of flow to inspect */
+#define SIG_MAXLEN 256      /* maximum pattern length */
+#define SIG_MAXPATTERNS INT16_MAX /* pattern index is kept in int16_t of flow state */
+
+struct sig_pattern
+{
+	char name[64];
+	double w;
+	int anchored;           /* pattern must start at first payload byte */
+	int len;
+};
+
+/* automaton state, transitions for all bytes (DFA) */
+struct sig_state
+{
+	int32_t next[256];
+	int32_t fail;
+	int32_t out;            /* pattern which ends in this state, -1 if none */
+	int32_t aout;           /* the same for anchored pattern, it has own output, so
+	                           the same bytes can be both anchored and not */
+	int32_t dict;           /* next state with pattern on failure chain, -1 if none */
+};
+
+static inline int
+sig_has_out(struct sig_state *st)
+{
+	return (st->out >= 0) || (st->aout >= 0);
+}
+
+/* per-flow state */
+struct sig_flow
+{
+	uint16_t packets;       /* inspected packets with payload */
+	int16_t sig;            /* pattern index + 1, 0 if unknown */
+};
+
+struct signature
+{
+	size_t module_number;
+
+	char file[PATH_MAX];
+	int packets;
+
+	struct sig_pattern *patterns;
+	size_t npatterns;
+
+	struct sig_state *states;
+	size_t nstates, states_alloc;
+};
+
+/* flow loaded from snapshot, signature file could be changed since then */
+static void
+signature_restore(void *arg, struct flow_key *key, void *flow)
+{
+	struct signature *data = arg;
+	struct sig_flow *f = flow;
+
+	if ((f->sig < 0) || ((size_t)f->sig > data->npatterns)) {
+		f->sig = 0;
+		f->packets = 0;
+	}
+}
+
+void *
+signature_init(struct userdata *u, size_t n)
+{
+	struct signature *data;
+
+	data = malloc(sizeof(struct signature));
+	if (!data) {
+		fprintf(stderr, "Module %s: malloc(%lu) failed\n",
+			modules[n].name, (long)sizeof(struct signature));
+		goto fail_alloc;
+	}
+
+	data->module_number = n;
+	data->file[0] = '\0';
+	data->packets = SIG_DEF_PACKETS;
+
+	data->patterns = NULL;
+	data->npatterns = 0;
+	data->states = NULL;
+	data->nstates = data->states_alloc = 0;
+
+	flow_register(n, FLOW_KEY_5TUPLE, sizeof(struct sig_flow), NULL);
+	modules[n].frestore = &signature_restore;
+
+	return data;
+
+fail_alloc:
+	return NULL;
+}
+
+void
+signature_conf(void *arg, char *param1, char *param2)
+{
+	struct signature *data = arg;
+
+	if (!strcmp(param1, "file")) {
+		strncpy(data->file, param2, PATH_MAX - 1);
+		data->file[PATH_MAX - 1] = '\0';
+	} else if (!strcmp(param1, "packets")) {
+		data->packets = atoi(param2);
+		if (data->packets <= 0) {
+			fprintf(stderr, "Module %s: strange packets value %d, using %d instead\n",
+				modules[data->module_number].name, data->packets, SIG_DEF_PACKETS);
+			data->packets = SIG_DEF_PACKETS;
+		}
+	} else {
+		fprintf(stderr, "Module %s: unknown config parameter '%s'\n",
+			modules[data->module_number].name, param1);
+	}
+}
+
+static int32_t
+sig_state_new(struct signature *data)
+{
+	struct sig_state *st;
+	size_t i;
+
+	if (data->nstates == data->states_alloc) {
+		size_t nalloc = data->states_alloc ? data->states_alloc * 2 : 256;
+		struct sig_state *tmp = realloc(data->states, nalloc * sizeof(struct sig_state));
+
+		if (!tmp) {
+			return -1;
+		}
+		data->states = tmp;
+		data->states_alloc = nalloc;
+	}
+
+	st = &data->states[data->nstates];
+	for (i=0; i<256; i++) {
+		st->next[i] = -1;
+	}
+	st->fail = 0;
+	st->out = -1;
+	st->aout = -1;
+	st->dict = -1;
+
+	return data->nstates++;
+}
+
+/* pattern with escapes: \xHH, \\, leading ^ anchors pattern at payload start */
+static int
+sig_parse_pattern(char *s, unsigned char *buf, int *anchored)
+{
+	int len = 0;
+
+	*anchored = 0;
+	if (*s == '^') {
+		*anchored = 1;
+		s++;
+	}
+
+	while (*s) {
+		if (len >= SIG_MAXLEN) {
+			return -1;
+		}
+		if ((s[0] == '\\') && (s[1] == 'x') && isxdigit(s[2]) && isxdigit(s[3])) {
+			char hex[3] = {s[2], s[3], '\0'};
+
+			buf[len++] = strtol(hex, NULL, 16);
+			s += 4;
+		} else if ((s[0] == '\\') && s[1]) {
+			buf[len++] = s[1];
+			s += 2;
+		} else {
+			buf[len++] = *s++;
+		}
+	}
+
+	return len;
+}
+
+/* add pattern to trie */
+static int
+sig_add(struct signature *data, unsigned char *p, int len, int idx)
+{
+	int32_t s = 0, *out;
+	int i;
+
+	for (i=0; i<len; i++) {
+		if (data->states[s].next[p[i]] < 0) {
+			int32_t t = sig_state_new(data);
+
+			if (t < 0) {
+				return 0;
+			}
+			data->states[s].next[p[i]] = t;
+		}
+		s = data->states[s].next[p[i]];
+	}
+
+	/* first pattern in file wins */
+	out = data->patterns[idx].anchored ? &data->states[s].aout : &data->states[s].out;
+	if (*out < 0) {
+		*out = idx;
+	}
+
+	return 1;
+}
+
+/* failure links, and trie to DFA */
+static int
+sig_build(struct signature *data)
+{
+	int32_t *queue;
+	size_t head = 0, tail = 0;
+	int c;
+
+	queue = malloc(data->nstates * sizeof(int32_t));
+	if (!queue) {
+		return 0;
+	}
+
+	for (c=0; c<256; c++) {
+		int32_t t = data->states[0].next[c];
+
+		if (t < 0) {
+			data->states[0].next[c] = 0;
+		} else {
+			data->states[t].fail = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail) {
+		int32_t s = queue[head++];
+
+		for (c=0; c<256; c++) {
+			int32_t t = data->states[s].next[c];
+			int32_t f = data->states[data->states[s].fail].next[c];
+
+			if (t < 0) {
+				data->states[s].next[c] = f;
+				continue;
+			}
+
+			data->states[t].fail = f;
+			data->states[t].dict = sig_has_out(&data->states[f]) ? f : data->states[f].dict;
+			queue[tail++] = t;
+		}
+	}
+
+	free(queue);
+	return 1;
+}
+
+/* read file with lines "name weight pattern" */
+static int
+sig_load(struct signature *data)
+{
+	FILE *f;
+	char line[LINE_MAX];
+	int lineno = 0;
+
+	f = fopen(data->file, "r");
+	if (!f) {
+		fprintf(stderr, "Module %s: can't open file '%s'\n",
+			modules[data->module_number].name, data->file);
+		return 0;
+	}
+
+	if (sig_state_new(data) < 0) {
+		goto fail;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char name[LINE_MAX], pattern[LINE_MAX];
+		unsigned char bytes[SIG_MAXLEN];
+		struct sig_pattern *tmp, *sp;
+		double w;
+		int len, anchored;
+
+		lineno++;
+		if ((sscanf(line, "%s %lf %s", name, &w, pattern) != 3) || (name[0] == '#')) {
+			continue;
+		}
+
+		len = sig_parse_pattern(pattern, bytes, &anchored);
+		if (len <= 0) {
+			fprintf(stderr, "Module %s: %s:%d: incorrect pattern\n",
+				modules[data->module_number].name, data->file, lineno);
+			continue;
+		}
+
+		if (data->npatterns == SIG_MAXPATTERNS) {
+			fprintf(stderr, "Module %s: %s:%d: too many patterns, maximum is %d\n",
+				modules[data->module_number].name, data->file, lineno, SIG_MAXPATTERNS);
+			fclose(f);
+			return 0;
+		}
+
+		tmp = realloc(data->patterns, (data->npatterns + 1) * sizeof(struct sig_pattern));
+		if (!tmp) {
+			goto fail;
+		}
+		data->patterns = tmp;
+
+		sp = &data->patterns[data->npatterns];
+		strncpy(sp->name, name, sizeof(sp->name) - 1);
+		sp->name[sizeof(sp->name) - 1] = '\0';
+		sp->w = w;
+		sp->anchored = anchored;
+		sp->len = len;
+
+		if (!sig_add(data, bytes, len, data->npatterns)) {
+			goto fail;
+		}
+		data->npatterns++;
+	}
+
+	if (!sig_build(data)) {
+		goto fail;
+	}
+
+	fprintf(stderr, "Module %s: %lu signatures loaded, %lu states\n",
+		modules[data->module_number].name, (long)data->npatterns, (long)data->nstates);
+
+	fclose(f);
+	return 1;
+
+fail:
+	fprintf(stderr, "Module %s: out of memory\n", modules[data->module_number].name);
+	fclose(f);
+	return 0;
+}
+
+int
+signature_postconf(void *arg)
+{
+	struct signature *data = arg;
+
+	if (data->file[0] == '\0') {
+		/* module is not used */
+		return MODULE_UNUSED;
+	}
+
+	return sig_load(data);
+}
+
+void
+signature_free(void *arg)
+{
+	struct signature *data = arg;
+
+	free(data->states);
+	free(data->patterns);
+	free(data);
+}
+
+/* returns pattern index + 1, or 0 */
+static int
+sig_match(struct signature *data, unsigned char *payload, int len)
+{
+	int32_t s = 0;
+	int i;
+
+	for (i=0; i<len; i++) {
+		int32_t t;
+
+		s = data->states[s].next[payload[i]];
+
+		for (t = sig_has_out(&data->states[s]) ? s : data->states[s].dict; t > 0; t = data->states[t].dict) {
+			struct sig_state *st = &data->states[t];
+			int32_t m = st->out;
+
+			/* anchored pattern matches only at payload start, if both
+			   match, the first in file wins */
+			if ((st->aout >= 0) && (i + 1 == data->patterns[st->aout].len)
+				&& ((m < 0) || (st->aout < m))) {
+				m = st->aout;
+			}
+			if (m >= 0) {
+				return m + 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+double
+signature_weight(void *arg, char *packet, int packetlen, int mark, void *flow, int *hints)
+{
+	struct signature *data = arg;
+	struct sig_flow *f = flow;
+	struct damper_ip_header *ip;
+	int hdrlen;
+
+	if ((!f->sig) && (f->packets < data->packets)) {
+		ip = (struct damper_ip_header *)packet;
+		hdrlen = (ip->ip_vhl & 0x0f) * 4;
+		if (ntohs(ip->ip_off) & IP_OFFMASK) {
+			/* non-first fragment, payload offset is unknown */
+			hdrlen = packetlen;
+		} else if (ip->ip_p == TCP_PROTO_NUM) {
+			hdrlen = (packetlen >= hdrlen + 20)
+				? hdrlen + (((unsigned char *)packet)[hdrlen + 12] >> 4) * 4
+				: packetlen;
+		} else if (ip->ip_p == UDP_PROTO_NUM) {
+			hdrlen += 8;
+		}
+
+		if (packetlen > hdrlen) {
+			/* packets without payload (handshake, ACKs) are not counted */
+			f->packets++;
+			f->sig = sig_match(data, (unsigned char *)packet + hdrlen, packetlen - hdrlen);
+		}
+
+		if ((!f->sig) && (f->packets < data->packets)) {
+			/* still inspecting, flow weight can't be cached */
+			*hints |= HINT_REFRESH;
+		}
+	}
+
+	return f->sig ? data->patterns[f->sig - 1].w : DBL_EPSILON;
+}
+
@@ -1,5 +1,5 @@
 /*
- $ cc -Wall -pedantic damper_img.c -o damper_img -lpng -pthread
+ $ cc -Wall -pedantic damper_img.c image.c stats.c -o damper_img -lpng -pthread -lm
  */
 #include <arpa/inet.h>
 #include <errno.h>
@@ -36,8 +36,18 @@ struct request
 	int w, h;          /* image width and height */
 	time_t start, end; /* start and end time of chart */
 	int pb;            /* packets or bytes, if zero display packets in chart */
+	int top;           /* top talkers instead of chart, number of keys */
+	int q;             /* queue chart instead of traffic, CHART_QUEUE or CHART_SOJOURN */
+	char wm[STAT_SERIES_NAME];  /* module for weight heatmap, empty if none */
+	int live;          /* stream of live records instead of chart */
 };
 
+#define CHART_QUEUE   1  /* packets or octets in queue: min, average and max */
+#define CHART_SOJOURN 2  /* time in queue, microseconds: p50, p99 and max */
+
+#define LIVE_POLL_MS   50   /* live ring is checked this often */
+#define LIVE_KEEPALIVE 15   /* seconds without records before comment is sent */
+
 /* response */
 struct response
 {
@@ -58,6 +68,13 @@ struct pixel_info
 	int dropped;
 };
 
+/* queue chart column: band from low to high, line at mid */
+struct band_info
+{
+	uint64_t low, mid, high;
+	int set;
+};
+
 
 /* weight chart related stuff */
 struct weight_chart
@@ -112,7 +129,7 @@ draw_bg(bitmap_t *bmp)
 	}
 }
 
-static uint32_t
+static uint64_t
 octets_or_packets(struct request *p, struct stat_info *i, int pass)
 {
 	if (p->pb) {
@@ -123,10 +140,10 @@ octets_or_packets(struct request *p, struct stat_info *i, int pass)
 }
 
 /* get peak chart value */
-static uint32_t
+static uint64_t
 chart_get_peak(struct request *p, struct stat_data *sd)
 {
-	uint32_t peak = 0;
+	uint64_t peak = 0;
 	int statret;
 	struct stat_info info;           /* data cursor value */
 
@@ -140,7 +157,8 @@ chart_get_peak(struct request *p, struct stat_data *sd)
 		p->end = p->start + sd->nrec;
 	}
 
-	statret = stat_data_seek(sd, "dstat", p->start, &info);
+	statret = stat_data_seek(sd, "dstat", (int64_t)p->start * 1000,
+		((int64_t)p->end - p->start) * 1000 / p->w, &info);
 	if (!statret) {
 		goto fail_statseek;
 	}
@@ -151,7 +169,7 @@ chart_get_peak(struct request *p, struct stat_data *sd)
 			break;
 		}
 
-		if (sd->t >= p->end) {
+		if (sd->t >= (int64_t)p->end * 1000) {
 			break;
 		}
 
@@ -254,19 +272,22 @@ chart_draw_row(bitmap_t * bmp, struct pixel_info *row, int line_prev, int h, int
 }
 
 static void
-chart_plot(struct request *p, struct stat_data *sd, uint32_t peak, bitmap_t *bmp)
+chart_plot(struct request *p, struct stat_data *sd, uint64_t peak, bitmap_t *bmp)
 {
 	int statret;
 	struct stat_info info;
 	int lines_per_row, line_prev = -1;
 	struct pixel_info *row;
+	int64_t start, span;    /* milliseconds */
 
 	statret = stat_data_open(sd);
 	if (!statret) {
 		return;
 	}
 
-	statret = stat_data_seek(sd, "dstat", p->start, &info);
+	start = (int64_t)p->start * 1000;
+	span = ((int64_t)p->end - p->start) * 1000;
+	statret = stat_data_seek(sd, "dstat", start, span / p->w, &info);
 	if (!statret) {
 		goto fail_statseek;
 	}
@@ -276,7 +297,8 @@ chart_plot(struct request *p, struct stat_data *sd, uint32_t peak, bitmap_t *bmp
 		goto fail_row;
 	}
 
-	lines_per_row = (p->end - p->start) / p->w + 2;
+	/* records per row */
+	lines_per_row = span / p->w / sd->res + 2;
 
 	line_prev = 0;
 	for (;;) {
@@ -287,15 +309,16 @@ chart_plot(struct request *p, struct stat_data *sd, uint32_t peak, bitmap_t *bmp
 			break;
 		}
 
-		if (sd->t >= p->end) {
+		if (sd->t >= start + span) {
 			break;
 		}
 
 		h_pass = (uint64_t)octets_or_packets(p, &info, 1) * p->h / (peak + 1);
 		h_drop = (uint64_t)octets_or_packets(p, &info, 0) * p->h / (peak + 1);
 
-		line_start = (uint64_t)p->w * (sd->t - p->start) / (p->end - p->start);
-		line_end   = (uint64_t)p->w * (sd->t - p->start + 1) / (p->end - p->start);
+		/* record may start before chart */
+		line_start = (sd->t > start) ? (uint64_t)p->w * (sd->t - start) / span : 0;
+		line_end   = (uint64_t)p->w * (sd->t - start + sd->res) / span;
 
 		if (line_end >= p->w) {
 			line_end = p->w - 1;
@@ -331,37 +354,17 @@ fail_statseek:
 	stat_data_close(sd);
 }
 
-/* draw chart */
+/* encode image to response, frees image */
 static struct response *
-build_chart(struct request *p)
+chart_response(struct request *p, bitmap_t *bmp, uint64_t peak)
 {
-	bitmap_t rep;
 	struct pngmembuf mempng;         /* png in memory */
 	struct response *r = NULL;       /* response */
-	struct stat_data sd;             /* statistics data */
-	uint32_t peak;                   /* maximum height */
-
-	/* create an image */
-	rep.width = p->w;
-	rep.height = p->h;
-
-	rep.pixels = calloc(sizeof(pixel_t), rep.width * rep.height);
-	if (!rep.pixels) {
-		goto fail_rep;
-	}
-
-	/* draw background */
-	draw_bg(&rep);
-
-	peak = chart_get_peak(p, &sd);
-	if (peak > 0) {
-		chart_plot(p, &sd, peak, &rep);
-	}
 
 	/* Write the image to memory */
 	mempng.len = 0;
 	mempng.ptr = NULL;
-	mk_mempng(&rep, &mempng);
+	mk_mempng(bmp, &mempng);
 
 	r = malloc(sizeof(struct response));
 	if (!r) {
@@ -388,7 +391,7 @@ build_chart(struct request *p)
 
 	/* free raw image */
 	free(mempng.ptr);
-	free(rep.pixels);
+	free(bmp->pixels);
 
 	return r;
 
@@ -396,13 +399,489 @@ fail_r_img:
 	free(r);
 
 fail_resp:
-	free(rep.pixels);
-
-fail_rep:
+	free(mempng.ptr);
+	free(bmp->pixels);
 
 	return NULL;
 }
 
+/* draw chart */
+static struct response *
+build_chart(struct request *p)
+{
+	bitmap_t rep;
+	struct stat_data sd;             /* statistics data */
+	uint64_t peak;                   /* maximum height */
+
+	/* create an image */
+	rep.width = p->w;
+	rep.height = p->h;
+
+	rep.pixels = calloc(sizeof(pixel_t), rep.width * rep.height);
+	if (!rep.pixels) {
+		return NULL;
+	}
+
+	/* draw background */
+	draw_bg(&rep);
+
+	peak = chart_get_peak(p, &sd);
+	if (peak > 0) {
+		chart_plot(p, &sd, peak, &rep);
+	}
+
+	return chart_response(p, &rep, peak);
+}
+
+/* low, mid and high value of queue chart from record */
+static void
+band_values(struct request *p, struct stat_queue_rec *q, uint64_t *v)
+{
+	if (p->q == CHART_SOJOURN) {
+		v[0] = q->sojourn[STAT_SOJOURN_P50];
+		v[1] = q->sojourn[STAT_SOJOURN_P99];
+		v[2] = q->sojourn[STAT_SOJOURN_MAX];
+	} else if (p->pb) {
+		v[0] = q->queue[STAT_QUEUE_OCTETS_MIN];
+		v[1] = q->queue[STAT_QUEUE_OCTETS_AVG];
+		v[2] = q->queue[STAT_QUEUE_OCTETS_MAX];
+	} else {
+		v[0] = q->queue[STAT_QUEUE_PACKETS_MIN];
+		v[1] = q->queue[STAT_QUEUE_PACKETS_AVG];
+		v[2] = q->queue[STAT_QUEUE_PACKETS_MAX];
+	}
+}
+
+/* fill chart columns, returns peak value */
+static uint64_t
+band_fill(struct request *p, struct band_info *cols)
+{
+	struct stat_data sd;
+	struct stat_info info;
+	struct stat_queue_rec q;
+	uint64_t peak = 0;
+	int64_t start, span;    /* milliseconds */
+
+	if (!stat_data_open(&sd)) {
+		return 0;
+	}
+
+	if (p->start == 0) {
+		p->start = sd.start;
+		p->end = p->start + sd.nrec;
+	}
+
+	start = (int64_t)p->start * 1000;
+	span = ((int64_t)p->end - p->start) * 1000;
+	if ((span <= 0) || !stat_data_seek(&sd, "dstat", start, span / p->w, &info)) {
+		goto done;
+	}
+
+	for (;;) {
+		int line_start, line_end, i;
+		uint64_t v[3];
+
+		stat_data_next(&sd, &info);
+		if (sd.t >= start + span) {
+			break;
+		}
+		if (!stat_data_queue(&sd, &q)) {
+			continue;
+		}
+		band_values(p, &q, v);
+		if (v[2] > peak) {
+			peak = v[2];
+		}
+
+		line_start = (sd.t > start) ? (uint64_t)p->w * (sd.t - start) / span : 0;
+		line_end   = (uint64_t)p->w * (sd.t - start + sd.res) / span;
+		if (line_end >= p->w) {
+			line_end = p->w - 1;
+		}
+
+		/* several records in column: widest band, highest line */
+		for (i=line_start; i<=line_end; i++) {
+			if (!cols[i].set) {
+				cols[i].low = v[0];
+				cols[i].mid = v[1];
+				cols[i].high = v[2];
+				cols[i].set = 1;
+				continue;
+			}
+			if (v[0] < cols[i].low) {
+				cols[i].low = v[0];
+			}
+			if (v[1] > cols[i].mid) {
+				cols[i].mid = v[1];
+			}
+			if (v[2] > cols[i].high) {
+				cols[i].high = v[2];
+			}
+		}
+	}
+
+done:
+	stat_data_close(&sd);
+	return peak;
+}
+
+/* draw queue or sojourn chart */
+static struct response *
+build_queue_chart(struct request *p)
+{
+	bitmap_t rep;
+	struct band_info *cols;
+	uint64_t peak;
+	int i;
+
+	if ((p->w <= 0) || (p->h <= 0)) {
+		return NULL;
+	}
+	rep.width = p->w;
+	rep.height = p->h;
+
+	rep.pixels = calloc(sizeof(pixel_t), rep.width * rep.height);
+	if (!rep.pixels) {
+		return NULL;
+	}
+	cols = calloc(p->w, sizeof(struct band_info));
+	if (!cols) {
+		free(rep.pixels);
+		return NULL;
+	}
+
+	draw_bg(&rep);
+
+	peak = band_fill(p, cols);
+	for (i=0; (peak > 0) && (i<p->w); i++) {
+		int y_low, y_mid, y_high;
+
+		if (!cols[i].set) {
+			continue;
+		}
+		y_low  = p->h - 1 - cols[i].low * p->h / (peak + 1);
+		y_mid  = p->h - 1 - cols[i].mid * p->h / (peak + 1);
+		y_high = p->h - 1 - cols[i].high * p->h / (peak + 1);
+
+		if (p->q == CHART_SOJOURN) {
+			vert_line(&rep, i, y_high, y_low + 1, 250, 210, 160);
+			put_pixel(&rep, i, y_mid, 200, 90, 0);
+		} else {
+			vert_line(&rep, i, y_high, y_low + 1, 190, 200, 250);
+			put_pixel(&rep, i, y_mid, 0, 0, 180);
+		}
+	}
+	free(cols);
+
+	return chart_response(p, &rep, peak);
+}
+
+/* sum weight histograms of module into chart columns, returns largest
+   number of samples in column */
+static uint64_t
+heatmap_fill(struct request *p, uint64_t *cols)
+{
+	struct stat_data sd;
+	struct stat_info info;
+	uint64_t peak = 0, hist[STAT_WHIST_NBUCKETS];
+	int64_t start, span;    /* milliseconds */
+	int i, b;
+
+	if (!stat_data_open(&sd)) {
+		return 0;
+	}
+
+	if (p->start == 0) {
+		p->start = sd.start;
+		p->end = p->start + sd.nrec;
+	}
+
+	start = (int64_t)p->start * 1000;
+	span = ((int64_t)p->end - p->start) * 1000;
+	if ((span <= 0) || !stat_data_seek(&sd, "dstat", start, span / p->w, &info)) {
+		goto done;
+	}
+
+	for (;;) {
+		int line_start, line_end;
+
+		stat_data_next(&sd, &info);
+		if (sd.t >= start + span) {
+			break;
+		}
+		if (!stat_data_whist(&sd, p->wm, hist)) {
+			continue;
+		}
+
+		line_start = (sd.t > start) ? (uint64_t)p->w * (sd.t - start) / span : 0;
+		line_end   = (uint64_t)p->w * (sd.t - start + sd.res) / span;
+		if (line_end >= p->w) {
+			line_end = p->w - 1;
+		}
+
+		for (i=line_start; i<=line_end; i++) {
+			for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+				cols[i * STAT_WHIST_NBUCKETS + b] += hist[b];
+			}
+		}
+	}
+
+	for (i=0; i<p->w; i++) {
+		uint64_t total = 0;
+
+		for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+			total += cols[i * STAT_WHIST_NBUCKETS + b];
+		}
+		if (total > peak) {
+			peak = total;
+		}
+	}
+
+done:
+	stat_data_close(&sd);
+	return peak;
+}
+
+/* draw weight heatmap of module: column for each time interval, row for
+   each bucket from 2^STAT_WHIST_MINEXP at bottom, darker if more weights */
+static struct response *
+build_heatmap(struct request *p)
+{
+	bitmap_t rep;
+	uint64_t *cols;
+	uint64_t peak;
+	int i, b;
+
+	if ((p->w <= 0) || (p->h <= 0)) {
+		return NULL;
+	}
+	rep.width = p->w;
+	rep.height = p->h;
+
+	rep.pixels = calloc(sizeof(pixel_t), rep.width * rep.height);
+	if (!rep.pixels) {
+		return NULL;
+	}
+	cols = calloc((size_t)p->w * STAT_WHIST_NBUCKETS, sizeof(uint64_t));
+	if (!cols) {
+		free(rep.pixels);
+		return NULL;
+	}
+
+	draw_bg(&rep);
+
+	peak = heatmap_fill(p, cols);
+	for (i=0; (peak > 0) && (i<p->w); i++) {
+		uint64_t *c = cols + i * STAT_WHIST_NBUCKETS, max = 0;
+
+		/* shade is relative to largest bucket of column */
+		for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+			if (c[b] > max) {
+				max = c[b];
+			}
+		}
+		for (b=0; (max > 0) && (b<STAT_WHIST_NBUCKETS); b++) {
+			int y_top = p->h - (b + 1) * p->h / STAT_WHIST_NBUCKETS;
+			int y_bottom = p->h - b * p->h / STAT_WHIST_NBUCKETS;
+			double x;
+
+			if (c[b] == 0) {
+				continue;
+			}
+			x = sqrt((double)c[b] / max);
+			vert_line(&rep, i, y_top, y_bottom, 255 - 215 * x, 240 - 200 * x, 250 - 90 * x);
+		}
+	}
+	free(cols);
+
+	return chart_response(p, &rep, peak);
+}
+
+/* top talkers as JSON array */
+static void
+top_json(char *buf, size_t len, struct stat_top_record *rec, size_t n, int flows)
+{
+	size_t i, off;
+
+	off = snprintf(buf, len, "[");
+	for (i=0; (i<n) && (off<len); i++) {
+		char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+
+		inet_ntop(AF_INET, &rec[i].saddr, src, sizeof(src));
+		inet_ntop(AF_INET, &rec[i].daddr, dst, sizeof(dst));
+
+		off += snprintf(buf + off, len - off, "%s\n{ \"src\": \"%s\", \"dst\": \"%s\"", i ? "," : "", src, dst);
+		if (flows && (off < len)) {
+			off += snprintf(buf + off, len - off, ", \"proto\": %u, \"sport\": %u, \"dport\": %u",
+				rec[i].proto, rec[i].sport, rec[i].dport);
+		}
+		if (off < len) {
+			off += snprintf(buf + off, len - off,
+				", \"octets_pass\": %llu, \"octets_drop\": %llu"
+				", \"packets_pass\": %llu, \"packets_drop\": %llu, \"err\": %llu }",
+				(unsigned long long)rec[i].octets_pass, (unsigned long long)rec[i].octets_drop,
+				(unsigned long long)rec[i].packets_pass, (unsigned long long)rec[i].packets_drop,
+				(unsigned long long)rec[i].err);
+		}
+	}
+	if (off < len) {
+		snprintf(buf + off, len - off, "]");
+	}
+}
+
+/* top talkers response, last hour by default */
+static char *
+build_top(struct request *p)
+{
+	struct stat_top_record *rec;
+	char *res, *hosts, *flows;
+	size_t n, len;
+
+	if (p->top > 1000) {
+		p->top = 1000;
+	}
+	if (p->start == 0) {
+		p->end = time(NULL);
+		p->start = p->end - 60 * 60;
+	}
+
+	len = 512 * p->top + 64;
+	rec = malloc(p->top * sizeof(struct stat_top_record));
+	res = malloc(2 * len + 1024);
+	hosts = malloc(len);
+	flows = malloc(len);
+	if (!rec || !res || !hosts || !flows) {
+		free(rec);
+		free(res);
+		free(hosts);
+		free(flows);
+		return NULL;
+	}
+
+	n = stat_top_read(p->start, p->end, STAT_TOP_HOSTS, rec, p->top);
+	top_json(hosts, len, rec, n, 0);
+	n = stat_top_read(p->start, p->end, STAT_TOP_FLOWS, rec, p->top);
+	top_json(flows, len, rec, n, 1);
+
+	snprintf(res, 2 * len + 1024,
+		"Status: 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"\r\n"
+		"{\n\"status\": \"ok\",\n\"start\": \"%ld\",\n\"end\": \"%ld\",\n"
+		"\"hosts\": %s,\n\"flows\": %s\n}\n",
+		(long)p->start, (long)p->end, hosts, flows);
+
+	free(rec);
+	free(hosts);
+	free(flows);
+
+	return res;
+}
+
+/* whole buffer is sent, socket buffer may take only part of it at once */
+static int
+send_all(int s, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = send(s, buf, len, MSG_NOSIGNAL);
+
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 1;
+}
+
+/* record of live ring as server-sent event, counters per second */
+static int
+live_event(char *buf, size_t len, struct stat_live_record *r, uint64_t id)
+{
+	uint64_t res = r->res ? r->res : 1000;
+
+	return snprintf(buf, len,
+		"id: %llu\n"
+		"data: { \"time\": %lld, \"res\": %llu"
+		", \"packets_pass\": %llu, \"octets_pass\": %llu"
+		", \"packets_drop\": %llu, \"octets_drop\": %llu"
+		", \"queue_packets\": %llu, \"queue_octets\": %llu"
+		", \"sojourn_p99\": %llu, \"sojourn_max\": %llu }\n\n",
+		(unsigned long long)id, (long long)r->time, (unsigned long long)res,
+		(unsigned long long)(r->counters[STAT_PACKETS_PASS] * 1000 / res),
+		(unsigned long long)(r->counters[STAT_OCTETS_PASS] * 1000 / res),
+		(unsigned long long)(r->counters[STAT_PACKETS_DROP] * 1000 / res),
+		(unsigned long long)(r->counters[STAT_OCTETS_DROP] * 1000 / res),
+		(unsigned long long)r->queue[STAT_QUEUE_PACKETS_AVG],
+		(unsigned long long)r->queue[STAT_QUEUE_OCTETS_AVG],
+		(unsigned long long)r->sojourn[STAT_SOJOURN_P99],
+		(unsigned long long)r->sojourn[STAT_SOJOURN_MAX]);
+}
+
+/* send records of live ring as server-sent events until client goes away,
+   first ones are all records in ring. returns 0 if there is no live ring */
+static int
+live_stream(int s)
+{
+	const char hdr[] =
+		"Status: 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"X-Accel-Buffering: no\r\n"
+		"\r\n";
+	struct stat_live l;
+	struct stat_live_record *rec;
+	uint64_t count = 0;
+	char buf[1024];
+	int idle = 0;
+
+	rec = malloc(STAT_LIVE_NREC * sizeof(struct stat_live_record));
+	if (!rec) {
+		return 0;
+	}
+	if (!stat_live_open(&l)) {
+		free(rec);
+		return 0;
+	}
+
+	if (!send_all(s, hdr, strlen(hdr))) {
+		goto done;
+	}
+
+	for (;;) {
+		size_t i, n;
+
+		n = stat_live_read(&l, &count, rec, STAT_LIVE_NREC);
+		for (i=0; i<n; i++) {
+			int len = live_event(buf, sizeof(buf), &rec[i], count - n + i + 1);
+
+			if (!send_all(s, buf, len)) {
+				goto done;
+			}
+		}
+
+		/* comment, so closed connection is noticed */
+		idle = n ? 0 : (idle + LIVE_POLL_MS);
+		if (idle >= LIVE_KEEPALIVE * 1000) {
+			if (!send_all(s, ":\n\n", 3)) {
+				goto done;
+			}
+			idle = 0;
+		}
+
+		usleep(LIVE_POLL_MS * 1000);
+	}
+
+done:
+	stat_live_close(&l);
+	free(rec);
+	return 1;
+}
+
 /* parse script params */
 void
 parse_params(struct request *p, char *q)
@@ -439,6 +918,15 @@ parse_params(struct request *p, char *q)
 			p->end = atol(ptr + 4);
 		} else if (memcmp(ptr, "pb=", 3) == 0) {
 			p->pb = atoi(ptr + 3);
+		} else if (memcmp(ptr, "top=", 4) == 0) {
+			p->top = atoi(ptr + 4);
+		} else if (memcmp(ptr, "q=", 2) == 0) {
+			p->q = atoi(ptr + 2);
+		} else if (memcmp(ptr, "live=", 5) == 0) {
+			p->live = atoi(ptr + 5);
+		} else if (memcmp(ptr, "wm=", 3) == 0) {
+			strncpy(p->wm, ptr + 3, sizeof(p->wm) - 1);
+			p->wm[sizeof(p->wm) - 1] = '\0';
 		}
 		ptr = last ? end : end + 1;
 	}
@@ -453,7 +941,7 @@ scgi_thread(void *arg)
 	char key[BUFSIZE], val[BUFSIZE];
 	char *start, *ptr;
 	ssize_t rres;
-	int rsize, i, stop_parse;
+	int rsize, i, stop_parse, streamed;
 	struct scgi_thread_arg *scgi = arg;
 	struct request req;
 	struct response *resp;
@@ -480,7 +968,12 @@ scgi_thread(void *arg)
 	ptr = start;
 	stop_parse = 0;
 	req.w = req.h = 0;
+	req.start = req.end = 0;
 	req.pb  = 1; /* bytes */
+	req.top = 0;
+	req.q = 0;
+	req.wm[0] = '\0';
+	req.live = 0;
 
 	for (;;) {
 		for (i=0; ; i++) {
@@ -519,9 +1012,25 @@ scgi_thread(void *arg)
 		/* incorrect size */
 	}
 
-	resp = build_chart(&req);
+	resp = NULL;
+	strresponse = NULL;
+	streamed = 0;
+	if (req.live) {
+		streamed = live_stream(scgi->s);
+	} else if (req.top > 0) {
+		strresponse = build_top(&req);
+	} else if ((req.q == CHART_QUEUE) || (req.q == CHART_SOJOURN)) {
+		resp = build_queue_chart(&req);
+	} else if (req.wm[0]) {
+		resp = build_heatmap(&req);
+	} else {
+		resp = build_chart(&req);
+	}
 
-	if (resp) {
+	if (strresponse) {
+		write(scgi->s, strresponse, strlen(strresponse));
+		free(strresponse);
+	} else if (resp) {
 		char strbuf[100];
 
 		strresponse = malloc(resp->img.len + resp->weights.len + 1024*4); /* image + 4k for other text */
@@ -572,7 +1081,7 @@ scgi_thread(void *arg)
 		}
 		free(resp);
 		free(strresponse);
-	} else {
+	} else if (!streamed) {
 		strresponse = malloc(1024*4);
 		strresponse[0] = '\0';
 		strcat(strresponse, "Status: 200 OK\r\n");
@@ -1,28 +1,201 @@
 #include <string.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <sched.h>
 
 #include "stats.h"
 
 #include "../day2epoch.h"
 
-/* fill day info */
+/* offset of column with name, 0 if there is no such series */
+static uint64_t
+stat_series_find(struct stat_series *s, size_t n, const char *name, uint32_t type)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		if ((s[i].type == type) && (!strncmp(s[i].name, name, STAT_SERIES_NAME))) {
+			return s[i].offset;
+		}
+	}
+
+	return 0;
+}
+
+/* queue and sojourn columns, all optional */
 static void
-stat_fill_dayinfo(const char *fn, int day, struct stat_dayinfo *di)
+stat_fill_queue(struct stat_dayinfo *di, struct stat_series *s, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<STAT_QUEUE_NSERIES; i++) {
+		di->qcol[i] = stat_series_find(s, n, stat_queue_name(i), STAT_SERIES_U64);
+	}
+	for (i=0; i<STAT_SOJOURN_NSERIES; i++) {
+		di->sjcol[i] = stat_series_find(s, n, stat_sojourn_name(i), STAT_SERIES_U64);
+	}
+
+	if (di->resolution > 1000) {
+		uint64_t h1;
+
+		/* histogram buckets are written one after another */
+		di->hcol = stat_series_find(s, n, "sojourn.0", STAT_SERIES_U64);
+		h1 = stat_series_find(s, n, "sojourn.1", STAT_SERIES_U64);
+		if (di->hcol && (h1 > di->hcol)) {
+			char name[STAT_SERIES_NAME];
+
+			di->hstride = h1 - di->hcol;
+			snprintf(name, sizeof(name), "sojourn.%d", STAT_HIST_NBUCKETS - 1);
+			if (stat_series_find(s, n, name, STAT_SERIES_U64)
+				!= di->hcol + (STAT_HIST_NBUCKETS - 1) * di->hstride) {
+
+				di->hcol = di->hstride = 0;
+			}
+		} else {
+			di->hcol = 0;
+		}
+	}
+}
+
+/* fine ring holds records of last 'nrec' ticks before newest one */
+static int
+stat_fine_window(FILE *f, struct stat_dayinfo *di)
+{
+	uint64_t *tm, max = 0;
+	size_t i;
+
+	tm = malloc(di->nrec * sizeof(uint64_t));
+	if (!tm) {
+		return 0;
+	}
+	if ((fseek(f, di->tcol, SEEK_SET) < 0)
+		|| (fread(tm, sizeof(uint64_t), di->nrec, f) != di->nrec)) {
+
+		free(tm);
+		return 0;
+	}
+	for (i=0; i<di->nrec; i++) {
+		if (tm[i] > max) {
+			max = tm[i];
+		}
+	}
+	free(tm);
+
+	if (max == 0) {
+		/* nothing is written yet */
+		return 0;
+	}
+	di->end = max + di->resolution;
+	di->start = di->end - (int64_t)di->nrec * di->resolution;
+
+	return 1;
+}
+
+/* fill day info, returns 0 if file is not readable. version 2 file
+   holds all counters, so it is added to "dstat" set */
+static int
+stat_fill_dayinfo(const char *fn, int day, struct stat_dayinfo *di, char *name)
 {
 	struct stat st;
+	struct stat_file_header h;
+	struct stat_series *s = NULL;
 	char path[PATH_MAX];
+	FILE *f;
+	time_t now;
 
+	memset(di, 0, sizeof(struct stat_dayinfo));
 	di->day = day;
-
-	di->start = day2epoch(day);
+	di->start = (int64_t)day2epoch(day) * 1000;
+	strncpy(di->file, fn, NAME_MAX);
 
 	snprintf(path, PATH_MAX, "/%s", fn);
-	stat(path, &st); /* FIXME: ignore error? */
-	di->end = di->start + st.st_size / sizeof(struct stat_info);
+	f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+
+	if ((fread(&h, 1, sizeof(h), f) == sizeof(h))
+		&& (memcmp(h.magic, STAT_TOP_MAGIC, sizeof(h.magic)) == 0)) {
+
+		/* top talkers, see stat_top_read() */
+		goto fail;
+	} else if ((memcmp(h.magic, STAT_FILE_MAGIC, sizeof(h.magic)) == 0)
+		|| (memcmp(h.magic, STAT_FINE_MAGIC, sizeof(h.magic)) == 0)) {
+
+		int fine = (memcmp(h.magic, STAT_FINE_MAGIC, sizeof(h.magic)) == 0);
+		size_t j;
+
+		if ((h.version != STAT_FILE_VERSION) || (h.resolution == 0) || (h.nseries == 0) || (h.nrec == 0)) {
+			goto fail;
+		}
+		di->version = 2;
+		di->resolution = fine ? h.resolution : h.resolution * 1000;
+		di->start = h.start * 1000;
+		di->end = di->start + (int64_t)h.nrec * di->resolution;
+
+		s = malloc(h.nseries * sizeof(struct stat_series));
+		if (!s) {
+			goto fail;
+		}
+		if (fread(s, sizeof(struct stat_series), h.nseries, f) != h.nseries) {
+			goto fail;
+		}
+
+		/* find counters by name */
+		for (j=0; j<STAT_NCOUNTERS; j++) {
+			di->col[j] = stat_series_find(s, h.nseries, stat_counter_name(j), STAT_SERIES_U64);
+			if (!di->col[j]) {
+				goto fail;
+			}
+		}
+
+		/* seconds in rollup record */
+		if (di->resolution > 1000) {
+			di->scol = stat_series_find(s, h.nseries, "seconds", STAT_SERIES_U64);
+			if (!di->scol) {
+				goto fail;
+			}
+		}
+
+		/* ring with time of each record */
+		if (fine) {
+			di->nrec = h.nrec;
+			di->tcol = stat_series_find(s, h.nseries, "time", STAT_SERIES_U64);
+			if (!di->tcol || !stat_fine_window(f, di)) {
+				goto fail;
+			}
+		}
+
+		stat_fill_queue(di, s, h.nseries);
+		free(s);
+		s = NULL;
+		strcpy(name, "dstat");
+	} else {
+		di->version = 1;
+		di->resolution = 1000;
+		fstat(fileno(f), &st);
+		di->end = di->start + (int64_t)(st.st_size / sizeof(struct stat_info_v1)) * 1000;
+	}
+	fclose(f);
+
+	/* damper preallocates whole day, records after now are not written yet */
+	now = time(NULL);
+	if (di->day && (di->end > (int64_t)now * 1000)) {
+		di->end = (int64_t)now * 1000;
+	}
+
+	return 1;
+
+fail:
+	free(s);
+	fclose(f);
+	return 0;
 }
 
 /* statistics files handling */
@@ -31,7 +204,7 @@ stat_data_open(struct stat_data *sd)
 {
 	DIR *dir;
 	struct dirent *de;
-	time_t tmmax = 0;
+	int64_t tmmin = 0, tmmax = 0;
 
 	memset(sd, 0, sizeof(struct stat_data));
 
@@ -47,7 +220,7 @@ stat_data_open(struct stat_data *sd)
 		char *day_start;
 		size_t len, extlen, i;
 		int daytmp, setidx;
-		struct stat_dayinfo *dtmp;
+		struct stat_dayinfo *dtmp, dinfo;
 
 		len = strlen(de->d_name);
 		extlen = strlen(ext);
@@ -61,21 +234,30 @@ stat_data_open(struct stat_data *sd)
 			continue;
 		}
 
-		memcpy(buf, de->d_name, len - extlen);
-		buf[len - extlen] = '\0';
+		if (strcmp(de->d_name, STAT_FINE_FILE) == 0) {
+			/* fine ring has no day in name */
+			daytmp = 0;
+		} else {
+			memcpy(buf, de->d_name, len - extlen);
+			buf[len - extlen] = '\0';
+
+			day_start = strrchr(buf, '.');
+			if (!day_start) {
+				/* no "." in file name */
+				continue;
+			}
+
+			memcpy(name, buf, day_start - buf);
+			name[day_start - buf] = '\0';
 
-		day_start = strrchr(buf, '.');
-		if (!day_start) {
-			/* no "." in file name */
-			continue;
+			day_start++;
+			daytmp = atoi(day_start);
+			if (daytmp <= 0) {
+				continue;
+			}
 		}
 
-		memcpy(name, buf, day_start - buf);
-		name[day_start - buf] = '\0';
-
-		day_start++;
-		daytmp = atoi(day_start);
-		if (daytmp <= 0) {
+		if (!stat_fill_dayinfo(de->d_name, daytmp, &dinfo, name)) {
 			continue;
 		}
 
@@ -113,22 +295,20 @@ stat_data_open(struct stat_data *sd)
 		sd->sets[setidx].days = dtmp;
 
 		/* mimimum time will be start of set */
-		stat_fill_dayinfo(de->d_name, daytmp, &sd->sets[setidx].days[sd->sets[setidx].ndays]);
-		if (sd->start == 0) {
-			sd->start = sd->sets[setidx].days[sd->sets[setidx].ndays].start;
-		} else if (sd->sets[setidx].days[sd->sets[setidx].ndays].start < sd->start) {
-			sd->start = sd->sets[setidx].days[sd->sets[setidx].ndays].start;
+		sd->sets[setidx].days[sd->sets[setidx].ndays] = dinfo;
+		if ((tmmin == 0) || (dinfo.start < tmmin)) {
+			tmmin = dinfo.start;
 		}
-
-		if (sd->sets[setidx].days[sd->sets[setidx].ndays].end > tmmax) {
-			tmmax = sd->sets[setidx].days[sd->sets[setidx].ndays].end;
+		if (dinfo.end > tmmax) {
+			tmmax = dinfo.end;
 		}
 
 		sd->sets[setidx].ndays++;
 	}
 	closedir(dir);
 
-	sd->nrec = tmmax - sd->start;
+	sd->start = tmmin / 1000;
+	sd->nrec = (tmmax - tmmin) / 1000;
 
 	return 1;
 
@@ -137,11 +317,27 @@ fail_dir:
 	return 0;
 }
 
+/* close data file of cursor */
+static void
+stat_data_release(struct stat_data *sd)
+{
+	if (sd->f) {
+		fclose(sd->f);
+		sd->f = NULL;
+	}
+	if (sd->map) {
+		munmap(sd->map, sd->maplen);
+		sd->map = NULL;
+	}
+	sd->dinfo = NULL;
+}
+
 void
 stat_data_close(struct stat_data *sd)
 {
 	size_t i;
 
+	stat_data_release(sd);
 	for (i=0; i<sd->nsets; i++) {
 		if (sd->sets[i].days) {
 			free(sd->sets[i].days);
@@ -149,54 +345,190 @@ stat_data_close(struct stat_data *sd)
 		}
 	}
 	free(sd->sets);
-	if (sd->f) {
-		fclose(sd->f);
-		sd->f = NULL;
-	}
 	sd->sets = NULL;
 }
 
-static void
-stat_data_fetch(struct stat_data *sd, struct stat_dayinfo *dinfo, struct stat_info *info)
+/* value of record idx in column at offset off of mapped file */
+static int
+stat_data_value(struct stat_data *sd, uint64_t off, long idx, uint64_t *v)
+{
+	off += idx * sizeof(uint64_t);
+	if (off + sizeof(uint64_t) > sd->maplen) {
+		return 0;
+	}
+	*v = *(uint64_t *)(sd->map + off);
+
+	return 1;
+}
+
+/* column index of record at cursor, -1 if fine ring has other record there */
+static long
+stat_data_index(struct stat_data *sd)
+{
+	struct stat_dayinfo *dinfo = sd->dinfo;
+	uint64_t tm;
+	long idx;
+
+	if (!dinfo->tcol) {
+		return (sd->t - dinfo->start) / dinfo->resolution;
+	}
+
+	idx = (sd->t / dinfo->resolution) % dinfo->nrec;
+	if (!stat_data_value(sd, dinfo->tcol, idx, &tm) || ((int64_t)tm != sd->t)) {
+		return -1;
+	}
+
+	return idx;
+}
+
+/* open file of day with cursor time, coarsest one with resolution not
+   above step, or finest one if all are coarser */
+static int
+stat_data_open_day(struct stat_data *sd)
 {
-	int dayfound;
-	size_t i, readres;
+	size_t i;
 	char path[PATH_MAX];
+	struct stat_dayinfo *dinfo = NULL;
+
+	if (sd->dinfo && (sd->t >= sd->dinfo->start) && (sd->t < sd->dinfo->end)
+		&& (sd->dinfo->resolution <= sd->step)) {
+
+		/* already open */
+		return 1;
+	}
 
-	dayfound = 0;
 	for (i=0; i<sd->sset->ndays; i++) {
-		dinfo = &sd->sset->days[i];
+		struct stat_dayinfo *d = &sd->sset->days[i];
 
-		if ((sd->t > dinfo->start) && (sd->t < dinfo->end)) {
-			/* found */
-			dayfound = 1;
-			break;
+		if ((sd->t < d->start) || (sd->t >= d->end)) {
+			continue;
+		}
+		if (!dinfo) {
+			dinfo = d;
+		} else if (d->resolution <= sd->step) {
+			if ((dinfo->resolution > sd->step) || (d->resolution > dinfo->resolution)) {
+				dinfo = d;
+			}
+		} else if ((dinfo->resolution > sd->step) && (d->resolution < dinfo->resolution)) {
+			dinfo = d;
 		}
 	}
-
-	/* not found */
-	if (!dayfound) {
-		/* zeros */
-		goto empty;
+	if (dinfo && (dinfo == sd->dinfo)) {
+		/* coarser than step, but there is no finer one */
+		return 1;
+	}
+	stat_data_release(sd);
+	if (!dinfo) {
+		return 0;
 	}
 
-	sd->day = dinfo->day;
-	if (!sd->f) {
-		snprintf(path, PATH_MAX, "/%s.%06d.dat", sd->sset->name, sd->day);
+	snprintf(path, PATH_MAX, "/%s", dinfo->file);
+	if (dinfo->version == 1) {
 		sd->f = fopen(path, "r");
 		if (!sd->f) {
-			goto empty;
+			return 0;
 		}
-
-		fseek(sd->f, (sd->t - dinfo->start) * sizeof(struct stat_info), SEEK_SET);
+		sd->pos = -1;
+	} else {
+		struct stat st;
+		int fd;
+		void *p;
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return 0;
+		}
+		if ((fstat(fd, &st) < 0) || (st.st_size == 0)) {
+			close(fd);
+			return 0;
+		}
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) {
+			return 0;
+		}
+		sd->map = p;
+		sd->maplen = st.st_size;
 	}
+	sd->dinfo = dinfo;
 
-	readres = fread(info, 1, sizeof(struct stat_info), sd->f);
-	if (readres != sizeof(struct stat_info)) {
-		fclose(sd->f);
-		sd->f = NULL;
+	return 1;
+}
+
+static void
+stat_data_fetch(struct stat_data *sd, struct stat_info *info)
+{
+	struct stat_dayinfo *dinfo;
+	long idx;
+
+	if (!stat_data_open_day(sd)) {
+		/* no data, skip it by steps */
+		sd->res = sd->step;
 		goto empty;
 	}
+	dinfo = sd->dinfo;
+	idx = (sd->t - dinfo->start) / dinfo->resolution;
+
+	/* cursor at start of record */
+	sd->res = dinfo->resolution;
+	sd->t = dinfo->start + idx * dinfo->resolution;
+
+	if (dinfo->version == 1) {
+		struct stat_info_v1 r;
+
+		if (sd->pos != idx) {
+			fseek(sd->f, idx * sizeof(struct stat_info_v1), SEEK_SET);
+		}
+		if (fread(&r, 1, sizeof(r), sd->f) != sizeof(r)) {
+			sd->pos = -1;
+			goto empty;
+		}
+		sd->pos = idx + 1;
+
+		info->packets_pass = r.packets_pass;
+		info->octets_pass  = r.octets_pass;
+		info->packets_drop = r.packets_drop;
+		info->octets_drop  = r.octets_drop;
+	} else {
+		uint64_t v[STAT_NCOUNTERS], n = 1;
+		int i;
+
+		idx = stat_data_index(sd);
+		if (idx < 0) {
+			goto empty;
+		}
+		for (i=0; i<STAT_NCOUNTERS; i++) {
+			if (!stat_data_value(sd, dinfo->col[i], idx, &v[i])) {
+				goto empty;
+			}
+		}
+
+		/* rollup has sums, average them */
+		if (dinfo->scol) {
+			if (!stat_data_value(sd, dinfo->scol, idx, &n) || (n == 0)) {
+				goto empty;
+			}
+			for (i=0; i<STAT_NCOUNTERS; i++) {
+				v[i] /= n;
+			}
+		}
+
+		/* fine record: to rate per second, if it is not rewritten meanwhile */
+		if (dinfo->tcol) {
+			__sync_synchronize();
+			if (stat_data_index(sd) != idx) {
+				goto empty;
+			}
+			for (i=0; i<STAT_NCOUNTERS; i++) {
+				v[i] = v[i] * 1000 / dinfo->resolution;
+			}
+		}
+
+		info->packets_pass = v[STAT_PACKETS_PASS];
+		info->octets_pass  = v[STAT_OCTETS_PASS];
+		info->packets_drop = v[STAT_PACKETS_DROP];
+		info->octets_drop  = v[STAT_OCTETS_DROP];
+	}
 
 	return;
 
@@ -205,12 +537,12 @@ empty:
 }
 
 int
-stat_data_seek(struct stat_data *sd, char *mname, time_t seekto, struct stat_info *info)
+stat_data_seek(struct stat_data *sd, char *mname, int64_t seekto, int64_t step, struct stat_info *info)
 {
 	size_t i;
-	struct stat_dayinfo *dinfo = NULL;
 
 	/* search for module with name in *mname */
+	stat_data_release(sd);
 	sd->sset = NULL;
 	for (i=0; i<sd->nsets; i++) {
 		if (strcmp(sd->sets[i].name, mname) == 0) {
@@ -226,8 +558,9 @@ stat_data_seek(struct stat_data *sd, char *mname, time_t seekto, struct stat_inf
 
 	/* search for day file */
 	sd->t = seekto;
+	sd->step = (step > 0) ? step : 1;
 
-	stat_data_fetch(sd, dinfo, info);
+	stat_data_fetch(sd, info);
 
 	return 1;
 }
@@ -235,38 +568,326 @@ stat_data_seek(struct stat_data *sd, char *mname, time_t seekto, struct stat_inf
 int
 stat_data_next(struct stat_data *sd, struct stat_info *info)
 {
-	size_t readres;
-	struct stat_dayinfo *dinfo = NULL;
+	sd->t += sd->res;
+
+	stat_data_fetch(sd, info);
+
+	return 1;
+}
 
-	sd->t++;
+int
+stat_data_queue(struct stat_data *sd, struct stat_queue_rec *q)
+{
+	struct stat_dayinfo *dinfo = sd->dinfo;
+	uint64_t n = 1;
+	long idx;
+	int i;
 
-	if (!sd->f) {
-		/* file not open */
-		goto next_file;
+	memset(q, 0, sizeof(struct stat_queue_rec));
+	if (!dinfo || !sd->map || (sd->t < dinfo->start) || (sd->t >= dinfo->end)) {
+		return 0;
+	}
+	idx = stat_data_index(sd);
+	if (idx < 0) {
+		return 0;
 	}
 
-	if (feof(sd->f)) {
-		fclose(sd->f);
-		sd->f = NULL;
-		goto next_file;
+	for (i=0; i<STAT_QUEUE_NSERIES; i++) {
+		if (!dinfo->qcol[i] || !stat_data_value(sd, dinfo->qcol[i], idx, &q->queue[i])) {
+			return 0;
+		}
 	}
 
-	readres = fread(info, 1, sizeof(struct stat_info), sd->f);
-	if (readres != sizeof(struct stat_info)) {
-		fclose(sd->f);
-		sd->f = NULL;
-		goto empty;
+	if (dinfo->scol) {
+		/* rollup: averages are summed, percentiles come from histogram */
+		uint64_t hist[STAT_HIST_NBUCKETS];
+
+		if (!stat_data_value(sd, dinfo->scol, idx, &n) || (n == 0)) {
+			return 0;
+		}
+		q->queue[STAT_QUEUE_PACKETS_AVG] /= n;
+		q->queue[STAT_QUEUE_OCTETS_AVG] /= n;
+
+		if (!dinfo->hcol || !dinfo->sjcol[STAT_SOJOURN_MAX]) {
+			return 0;
+		}
+		for (i=0; i<STAT_HIST_NBUCKETS; i++) {
+			if (!stat_data_value(sd, dinfo->hcol + i * dinfo->hstride, idx, &hist[i])) {
+				return 0;
+			}
+		}
+		q->sojourn[STAT_SOJOURN_P50] = stat_hist_percentile(hist, 50);
+		q->sojourn[STAT_SOJOURN_P90] = stat_hist_percentile(hist, 90);
+		q->sojourn[STAT_SOJOURN_P99] = stat_hist_percentile(hist, 99);
+
+		return stat_data_value(sd, dinfo->sjcol[STAT_SOJOURN_MAX], idx, &q->sojourn[STAT_SOJOURN_MAX]);
+	}
+
+	for (i=0; i<STAT_SOJOURN_NSERIES; i++) {
+		if (!dinfo->sjcol[i] || !stat_data_value(sd, dinfo->sjcol[i], idx, &q->sojourn[i])) {
+			return 0;
+		}
 	}
+
+	if (dinfo->tcol) {
+		/* fine record could be rewritten while it was read */
+		__sync_synchronize();
+		if (stat_data_index(sd) != idx) {
+			return 0;
+		}
+	}
+
 	return 1;
+}
+
+/* order by key, then by octets */
+static int
+stat_top_cmp_key(const void *a, const void *b)
+{
+	return memcmp(a, b, offsetof(struct stat_top_record, octets_pass));
+}
+
+static int
+stat_top_cmp_octets(const void *a, const void *b)
+{
+	const struct stat_top_record *ra = a, *rb = b;
+	uint64_t oa = ra->octets_pass + ra->octets_drop;
+	uint64_t ob = rb->octets_pass + rb->octets_drop;
+
+	if (oa == ob) {
+		return 0;
+	}
+	return (oa < ob) ? 1 : -1;
+}
+
+size_t
+stat_top_read(time_t start, time_t end, int kind, struct stat_top_record *res, size_t n)
+{
+	struct stat_top_record *all = NULL;
+	size_t nall = 0, allocated = 0, i, j;
+	time_t day;
+
+	for (day = start - (start % STAT_DAY_SECONDS); day < end; day += STAT_DAY_SECONDS) {
+		struct stat_top_header *th;
+		struct stat st;
+		struct tm tm;
+		char path[PATH_MAX];
+		unsigned char *map;
+		time_t m, mstart, mend;
+		int fd;
+
+		gmtime_r(&day, &tm);
+		snprintf(path, PATH_MAX, "/top.%02d%02d%02d.dat", tm.tm_mday, tm.tm_mon + 1, tm.tm_year - 100);
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(struct stat_top_header))) {
+			close(fd);
+			continue;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			continue;
+		}
+
+		th = (struct stat_top_header *)map;
+		if (memcmp(th->magic, STAT_TOP_MAGIC, sizeof(th->magic))
+			|| (th->ntop == 0)
+			|| ((size_t)st.st_size < stat_top_offset(th->ntop, STAT_TOP_MINUTES, 0))) {
+
+			munmap(map, st.st_size);
+			continue;
+		}
+
+		/* minutes of day in range */
+		mstart = (start > th->start) ? (start - th->start) / 60 : 0;
+		mend = (end - th->start + 59) / 60;
+		if (mend > STAT_TOP_MINUTES) {
+			mend = STAT_TOP_MINUTES;
+		}
+
+		for (m=mstart; m<mend; m++) {
+			struct stat_top_record *rec;
+
+			rec = (struct stat_top_record *)(map + stat_top_offset(th->ntop, m, kind));
+			for (i=0; i<th->ntop; i++) {
+				if ((rec[i].octets_pass + rec[i].octets_drop) == 0) {
+					break;
+				}
+				if (nall == allocated) {
+					struct stat_top_record *tmp;
+
+					allocated = allocated ? allocated * 2 : 1024;
+					tmp = realloc(all, allocated * sizeof(struct stat_top_record));
+					if (!tmp) {
+						munmap(map, st.st_size);
+						goto fail;
+					}
+					all = tmp;
+				}
+				all[nall++] = rec[i];
+			}
+		}
+
+		munmap(map, st.st_size);
+	}
+
+	if (nall == 0) {
+		return 0;
+	}
+
+	/* sum records of each key */
+	qsort(all, nall, sizeof(struct stat_top_record), &stat_top_cmp_key);
+	for (i=0, j=1; j<nall; j++) {
+		if (stat_top_cmp_key(&all[i], &all[j]) == 0) {
+			all[i].octets_pass += all[j].octets_pass;
+			all[i].octets_drop += all[j].octets_drop;
+			all[i].packets_pass += all[j].packets_pass;
+			all[i].packets_drop += all[j].packets_drop;
+			all[i].err += all[j].err;
+		} else {
+			all[++i] = all[j];
+		}
+	}
+	nall = i + 1;
+
+	qsort(all, nall, sizeof(struct stat_top_record), &stat_top_cmp_octets);
+	if (n > nall) {
+		n = nall;
+	}
+	memcpy(res, all, n * sizeof(struct stat_top_record));
+	free(all);
+
+	return n;
+
+fail:
+	free(all);
+	return 0;
+}
+
+int
+stat_data_whist(struct stat_data *sd, const char *mname, uint64_t *hist)
+{
+	struct stat_dayinfo *dinfo = sd->dinfo;
+	struct stat_file_header *h;
+	uint64_t off;
+	long idx;
+	int b;
+
+	memset(hist, 0, STAT_WHIST_NBUCKETS * sizeof(uint64_t));
+	if (!dinfo || !sd->map || (sd->t < dinfo->start) || (sd->t >= dinfo->end)) {
+		return 0;
+	}
 
-next_file:
-	stat_data_fetch(sd, dinfo, info);
+	/* series table of mapped file */
+	h = (struct stat_file_header *)sd->map;
+	if (sizeof(*h) + (size_t)h->nseries * sizeof(struct stat_series) > sd->maplen) {
+		return 0;
+	}
+	off = stat_series_find((struct stat_series *)(sd->map + sizeof(*h)), h->nseries, mname, STAT_SERIES_WHIST);
+	idx = stat_data_index(sd);
+	if (!off || (idx < 0)) {
+		return 0;
+	}
+
+	off += idx * STAT_WHIST_NBUCKETS;
+	if (off + STAT_WHIST_NBUCKETS > sd->maplen) {
+		return 0;
+	}
+	for (b=0; b<STAT_WHIST_NBUCKETS; b++) {
+		hist[b] = stat_whist_decode(sd->map[off + b]);
+	}
 
 	return 1;
+}
 
-empty:
-	memset(info, 0, sizeof(struct stat_info));
+int
+stat_live_open(struct stat_live *l)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+	void *p;
+
+	memset(l, 0, sizeof(struct stat_live));
+
+	snprintf(path, PATH_MAX, "/%s", STAT_LIVE_FILE);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(struct stat_live_header))) {
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return 0;
+	}
+	l->map = p;
+	l->maplen = st.st_size;
 
 	return 1;
 }
 
+void
+stat_live_close(struct stat_live *l)
+{
+	if (l->map) {
+		munmap(l->map, l->maplen);
+		l->map = NULL;
+	}
+}
+
+size_t
+stat_live_read(struct stat_live *l, uint64_t *count, struct stat_live_record *rec, size_t n)
+{
+	volatile struct stat_live_header *h = (struct stat_live_header *)l->map;
+	struct stat_live_record *ring = (struct stat_live_record *)(l->map + sizeof(struct stat_live_header));
+	int retry;
+
+	if (n > STAT_LIVE_NREC) {
+		n = STAT_LIVE_NREC;
+	}
+
+	for (retry=0; retry<1000; retry++) {
+		uint64_t seq, total, from, i;
+
+		seq = h->seq;
+		if (seq & 1) {
+			/* record is written just now */
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+
+		if (memcmp((char *)h->magic, STAT_LIVE_MAGIC, sizeof(h->magic))
+			|| (h->nrec != STAT_LIVE_NREC)
+			|| (sizeof(struct stat_live_header) + h->nrec * sizeof(struct stat_live_record) > l->maplen)) {
+
+			return 0;
+		}
+
+		/* newest records, all of them if daemon is restarted */
+		total = h->count;
+		from = (*count > total) ? 0 : *count;
+		if (total - from > n) {
+			from = total - n;
+		}
+		for (i=from; i<total; i++) {
+			rec[i - from] = ring[i % h->nrec];
+		}
+
+		__sync_synchronize();
+		if (h->seq == seq) {
+			*count = total;
+			return total - from;
+		}
+	}
+
+	return 0;
+}
@@ -5,11 +5,33 @@
 #include <stdlib.h>
 
 #include "../damper.h"
+#include "../statfile.h"
 
 struct stat_dayinfo
 {
-	int day;            /* day (DDMMYY in file name) */
-	time_t start, end;
+	int day;            /* day (DDMMYY in file name), 0 for fine ring */
+	int64_t start, end; /* milliseconds since epoch */
+
+	char file[NAME_MAX + 1];
+	int version;        /* 1: array of struct stat_info_v1, 2: columns, see statfile.h */
+	uint32_t resolution;                /* milliseconds per record */
+	uint64_t col[STAT_NCOUNTERS];      /* version 2: offsets of counter columns */
+	uint64_t scol;                      /* rollups: offset of seconds column */
+	uint64_t tcol;                      /* fine ring: offset of time column */
+	uint32_t nrec;                      /* fine ring: records in ring */
+
+	/* queue and sojourn columns, 0 if file has no such series */
+	uint64_t qcol[STAT_QUEUE_NSERIES];
+	uint64_t sjcol[STAT_SOJOURN_NSERIES]; /* rollups have maximum only */
+	uint64_t hcol, hstride;             /* rollups: first histogram bucket, distance to next */
+};
+
+/* queue occupancy and sojourn time (microseconds) of record, indexed by
+   STAT_QUEUE_* and STAT_SOJOURN_* */
+struct stat_queue_rec
+{
+	uint64_t queue[STAT_QUEUE_NSERIES];
+	uint64_t sojourn[STAT_SOJOURN_NSERIES];
 };
 
 struct stat_set
@@ -25,22 +47,56 @@ struct stat_data
 	struct stat_set *sets;   /* data sets */
 	size_t nsets;            /* number of sets */
 
-	size_t nrec;             /* number of records in dataset */
+	size_t nrec;             /* number of seconds in dataset */
 	time_t start;            /* time of first day in statistics files */
 
-	/* cursor */
+	/* cursor, times are in milliseconds */
 	struct stat_set *sset;
-	time_t t;                /* time */
-	FILE *f;                 /* data file */
-	int day;                 /* day */
+	struct stat_dayinfo *dinfo; /* day of open file */
+	int64_t t;               /* time */
+	int64_t step;            /* requested milliseconds per point */
+	int64_t res;             /* milliseconds in current record */
+	FILE *f;                 /* version 1 data file */
+	long pos;                /* next record in version 1 file */
+	unsigned char *map;      /* version 2 data file */
+	size_t maplen;
 };
 
 
 int stat_data_open(struct stat_data *sd);
 void stat_data_close(struct stat_data *sd);
 
-int stat_data_seek(struct stat_data *sd, char *mname, time_t seekto, struct stat_info *info);
+/* records are averaged per second, and taken from coarsest file with not more
+   than 'step' milliseconds per record, records shorter than second come from
+   fine ring. sd->t and sd->res tell time span of record */
+int stat_data_seek(struct stat_data *sd, char *mname, int64_t seekto, int64_t step, struct stat_info *info);
 int stat_data_next(struct stat_data *sd, struct stat_info *info);
 
+/* queue and sojourn time of record at cursor, returns 0 if file has none */
+int stat_data_queue(struct stat_data *sd, struct stat_queue_rec *q);
+
+/* weight histogram of module at cursor, STAT_WHIST_NBUCKETS counts of
+   record (not averaged per second), returns 0 if file has none */
+int stat_data_whist(struct stat_data *sd, const char *mname, uint64_t *hist);
+
+/* live ring of daemon */
+struct stat_live
+{
+	unsigned char *map;
+	size_t maplen;
+};
+
+int stat_live_open(struct stat_live *l);
+void stat_live_close(struct stat_live *l);
+
+/* copy records written after '*count' to rec, newest 'n' at most, and
+   set '*count' to count of written records. returns number of copied
+   records, so caller can wait for new ones without reading old ones */
+size_t stat_live_read(struct stat_live *l, uint64_t *count, struct stat_live_record *rec, size_t n);
+
+/* top talkers of [start, end) summed over minutes, 'kind' is STAT_TOP_HOSTS or
+   STAT_TOP_FLOWS. returns number of records in res, up to n, sorted by octets */
+size_t stat_top_read(time_t start, time_t end, int kind, struct stat_top_record *res, size_t n);
+
 #endif
 
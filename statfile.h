@@ -0,0 +1,365 @@
+#ifndef statfile_h_included
+#define statfile_h_included
+
+/*
+ * statistics day file, version 2
+ *
+ * header, table of series, then one column for each series with 'nrec'
+ * 64-bit values, record i is for time start + i * resolution.
+ * columns are page aligned (or cache line aligned if shorter than page),
+ * so reader can scan one series sequentially
+ *
+ * damper.DDMMYY.dat has record for each second, damper-m.DDMMYY.dat and
+ * damper-h.DDMMYY.dat are minute and hour rollups of the same day.
+ * series are found by name, so reader skips series it doesn't know
+ */
+
+#define STAT_DAY_SECONDS  (60 * 60 * 24)
+
+#define STAT_FILE_MAGIC   "DMPRSTAT"
+#define STAT_FILE_VERSION 2
+#define STAT_FILE_ALIGN   4096
+#define STAT_FILE_ALIGN_SHORT 64
+#define STAT_SERIES_NAME  32
+
+/* series value types */
+#define STAT_SERIES_U64    1
+#define STAT_SERIES_DOUBLE 2
+#define STAT_SERIES_WHIST  3    /* weight histogram, STAT_WHIST_NBUCKETS bytes per record */
+
+struct stat_file_header
+{
+	char magic[8];          /* written last, file without magic is not ready */
+	uint32_t version;
+	uint32_t resolution;    /* seconds per record */
+	uint32_t nrec;          /* records in each column */
+	uint32_t nseries;
+	int64_t start;          /* time of first record */
+};
+
+struct stat_series
+{
+	char name[STAT_SERIES_NAME];
+	uint32_t type;
+	uint32_t pad;
+	uint64_t offset;        /* offset of column from start of file */
+};
+
+/* counters of struct stat_info are first series in file */
+#define STAT_PACKETS_PASS 0
+#define STAT_OCTETS_PASS  1
+#define STAT_PACKETS_DROP 2
+#define STAT_OCTETS_DROP  3
+#define STAT_NCOUNTERS    4
+
+static inline const char *
+stat_counter_name(int i)
+{
+	static const char *names[STAT_NCOUNTERS] = {
+		"packets_pass", "octets_pass", "packets_drop", "octets_drop"
+	};
+
+	return names[i];
+}
+
+/* queue occupancy of second: minimum, time-weighted average and maximum
+   of packets and octets in queue. follow counters in day file */
+#define STAT_QUEUE_PACKETS_MIN 0
+#define STAT_QUEUE_PACKETS_AVG 1
+#define STAT_QUEUE_PACKETS_MAX 2
+#define STAT_QUEUE_OCTETS_MIN  3
+#define STAT_QUEUE_OCTETS_AVG  4
+#define STAT_QUEUE_OCTETS_MAX  5
+#define STAT_QUEUE_NSERIES     6
+
+static inline const char *
+stat_queue_name(int i)
+{
+	static const char *names[STAT_QUEUE_NSERIES] = {
+		"queue_packets.min", "queue_packets.avg", "queue_packets.max",
+		"queue_octets.min", "queue_octets.avg", "queue_octets.max"
+	};
+
+	return names[i];
+}
+
+/* sojourn time (enqueue to verdict) of packets sent from queue, microseconds.
+   day file has percentiles of second, rollups have histogram */
+#define STAT_SOJOURN_P50     0
+#define STAT_SOJOURN_P90     1
+#define STAT_SOJOURN_P99     2
+#define STAT_SOJOURN_MAX     3
+#define STAT_SOJOURN_NSERIES 4
+
+static inline const char *
+stat_sojourn_name(int i)
+{
+	static const char *names[STAT_SOJOURN_NSERIES] = {
+		"sojourn.p50", "sojourn.p90", "sojourn.p99", "sojourn.max"
+	};
+
+	return names[i];
+}
+
+/* day file: counters, queue, sojourn, then module weight histograms */
+#define STAT_DAY_QUEUE   STAT_NCOUNTERS
+#define STAT_DAY_SOJOURN (STAT_DAY_QUEUE + STAT_QUEUE_NSERIES)
+#define STAT_DAY_WEIGHTS (STAT_DAY_SOJOURN + STAT_SOJOURN_NSERIES)
+
+/*
+ * sojourn histogram, HDR-like: values below 2 * STAT_HIST_SUB have own
+ * bucket, then each power of two is split into STAT_HIST_SUB buckets, so
+ * relative error is below 1 / STAT_HIST_SUB. values from 2^STAT_HIST_MAXBITS
+ * microseconds (16.7 s) go to last bucket
+ */
+#define STAT_HIST_SUBBITS  3
+#define STAT_HIST_SUB      (1 << STAT_HIST_SUBBITS)
+#define STAT_HIST_MAXBITS  24
+#define STAT_HIST_NBUCKETS ((STAT_HIST_MAXBITS - STAT_HIST_SUBBITS + 1) * STAT_HIST_SUB)
+
+static inline int
+stat_hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v >= ((uint64_t)1 << STAT_HIST_MAXBITS)) {
+		v = ((uint64_t)1 << STAT_HIST_MAXBITS) - 1;
+	}
+	if (v < 2 * STAT_HIST_SUB) {
+		return v;
+	}
+	shift = 63 - __builtin_clzll(v) - STAT_HIST_SUBBITS;
+
+	return shift * STAT_HIST_SUB + (v >> shift);
+}
+
+/* lowest value of bucket, STAT_HIST_NBUCKETS gives end of last one */
+static inline uint64_t
+stat_hist_value(int b)
+{
+	int shift;
+
+	if (b < 2 * STAT_HIST_SUB) {
+		return b;
+	}
+	shift = b / STAT_HIST_SUB - 1;
+
+	return (uint64_t)(b - shift * STAT_HIST_SUB) << shift;
+}
+
+/* value below which 'p' percent of histogram values are, upper bound of bucket */
+static inline uint64_t
+stat_hist_percentile(const uint64_t *hist, int p)
+{
+	uint64_t total = 0, want, sum = 0;
+	int b;
+
+	for (b=0; b<STAT_HIST_NBUCKETS; b++) {
+		total += hist[b];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	want = (total * p + 99) / 100;
+	for (b=0; b<STAT_HIST_NBUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum >= want) {
+			break;
+		}
+	}
+
+	return stat_hist_value(b + 1) - 1;
+}
+
+/* rollup files: sum of each counter (named as counter), then minimum
+   ("packets_pass.min") and maximum ("packets_pass.max") of per-second
+   values, and number of seconds in record. then queue occupancy with
+   minimum, sum of per-second averages and maximum, maximum sojourn time
+   and sojourn histogram ("sojourn.0" ... "sojourn.175"), then module
+   weight histograms of record */
+#define STAT_ROLLUP_MIN     STAT_NCOUNTERS
+#define STAT_ROLLUP_MAX     (2 * STAT_NCOUNTERS)
+#define STAT_ROLLUP_SECONDS (3 * STAT_NCOUNTERS)
+#define STAT_ROLLUP_QUEUE   (STAT_ROLLUP_SECONDS + 1)
+#define STAT_ROLLUP_SOJOURN_MAX (STAT_ROLLUP_QUEUE + STAT_QUEUE_NSERIES)
+#define STAT_ROLLUP_HIST    (STAT_ROLLUP_SOJOURN_MAX + 1)
+#define STAT_ROLLUP_NSERIES (STAT_ROLLUP_HIST + STAT_HIST_NBUCKETS)
+#define STAT_ROLLUP_WEIGHTS STAT_ROLLUP_NSERIES
+
+/*
+ * module weights with 'wchart yes', series named as module: histogram with
+ * bucket for each power of two, bucket b counts weights from
+ * 2^(b + STAT_WHIST_MINEXP) to 2^(b + 1 + STAT_WHIST_MINEXP), first and
+ * last ones also take weights below and above. count of each bucket is
+ * stored in one byte, see stat_whist_encode()
+ */
+#define STAT_WHIST_NBUCKETS 32
+#define STAT_WHIST_MINEXP   (-12)
+
+static inline int
+stat_whist_bucket(double w)
+{
+	int e;
+
+	if (!(w > 0.0)) {
+		return 0;
+	}
+	frexp(w, &e);   /* w is in [2^(e-1), 2^e) */
+	e -= 1 + STAT_WHIST_MINEXP;
+	if (e < 0) {
+		return 0;
+	}
+
+	return (e < STAT_WHIST_NBUCKETS) ? e : (STAT_WHIST_NBUCKETS - 1);
+}
+
+/* count in byte: exact below 16, then 8 steps for each power of two, so
+   decoded value is within 6.25%. saturates at 2^34 */
+static inline uint8_t
+stat_whist_encode(uint64_t v)
+{
+	int e;
+
+	if (v < 16) {
+		return v;
+	}
+	e = 63 - __builtin_clzll(v);
+	if (e > 33) {
+		return 255;
+	}
+
+	return 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+}
+
+/* middle of step */
+static inline uint64_t
+stat_whist_decode(uint8_t c)
+{
+	int shift;
+
+	if (c < 16) {
+		return c;
+	}
+	shift = (c - 16) / 8 + 1;
+
+	return ((uint64_t)(8 + (c - 16) % 8) << shift) + ((uint64_t)1 << shift) / 2;
+}
+
+/*
+ * fine statistics damper-f.dat: ring of records shorter than second for
+ * last few minutes, same layout as day file, but 'resolution' is in
+ * milliseconds and 'start' is 0. record starting at ms since epoch T is in
+ * slot (T / resolution) % nrec, "time" series holds T and is written last,
+ * so reader can tell valid records. series are "time", counters, queue and
+ * sojourn percentiles of record
+ */
+#define STAT_FINE_MAGIC    "DMPRFINE"
+#define STAT_FINE_FILE     "damper-f.dat"
+#define STAT_FINE_TIME     0
+#define STAT_FINE_COUNTERS 1
+#define STAT_FINE_QUEUE    (STAT_FINE_COUNTERS + STAT_NCOUNTERS)
+#define STAT_FINE_SOJOURN  (STAT_FINE_QUEUE + STAT_QUEUE_NSERIES)
+#define STAT_FINE_NSERIES  (STAT_FINE_SOJOURN + STAT_SOJOURN_NSERIES)
+
+/*
+ * live statistics damper.live: ring of last STAT_LIVE_NREC ticks of stat
+ * thread, for viewers which poll it. writer makes 'seq' odd, writes record
+ * to slot count % STAT_LIVE_NREC, increments 'count' and makes 'seq' even
+ * again. reader copies records and retries if 'seq' was odd or changed
+ * meanwhile (seqlock), so writer never waits for readers
+ */
+#define STAT_LIVE_MAGIC "DMPRLIVE"
+#define STAT_LIVE_FILE  "damper.live"
+#define STAT_LIVE_NREC  1024
+
+struct stat_live_header
+{
+	char magic[8];
+	uint32_t nrec;
+	uint32_t pad;
+	uint64_t seq;
+	uint64_t count;         /* records written since daemon start */
+};
+
+struct stat_live_record
+{
+	int64_t time;           /* start of record, ms since epoch */
+	uint64_t res;           /* milliseconds in record */
+	uint64_t counters[STAT_NCOUNTERS];      /* sums for record, not per second */
+	uint64_t queue[STAT_QUEUE_NSERIES];
+	uint64_t sojourn[STAT_SOJOURN_NSERIES];
+};
+
+/*
+ * top talkers day file top.DDMMYY.dat: header, then for each minute of day
+ * 'ntop' records of host pairs followed by 'ntop' records of flows, sorted
+ * by octets. record with zero octets is empty
+ */
+#define STAT_TOP_MAGIC   "DMPRTOP1"
+#define STAT_TOP_HOSTS   0
+#define STAT_TOP_FLOWS   1
+#define STAT_TOP_NKEYS   2
+#define STAT_TOP_MINUTES (24 * 60)
+
+struct stat_top_header
+{
+	char magic[8];
+	uint32_t ntop;          /* records for each minute and key type */
+	uint32_t pad;
+	int64_t start;          /* time of first minute */
+};
+
+struct stat_top_record
+{
+	uint32_t saddr, daddr;  /* network byte order */
+	uint16_t sport, dport;
+	uint8_t  proto;
+	uint8_t  pad[3];
+	uint64_t octets_pass, octets_drop;
+	uint64_t packets_pass, packets_drop;
+	uint64_t err;           /* octets could be overestimated by this value */
+};
+
+static inline size_t
+stat_top_offset(uint32_t ntop, size_t minute, int kind)
+{
+	return sizeof(struct stat_top_header)
+		+ (minute * STAT_TOP_NKEYS + kind) * ntop * sizeof(struct stat_top_record);
+}
+
+/* record of version 1 file (dstat.DDMMYY.dat without header) */
+struct stat_info_v1
+{
+	uint32_t packets_pass, octets_pass;
+	uint32_t packets_drop, octets_drop;
+} __attribute__((packed));
+
+/* bytes of series value */
+static inline size_t
+stat_series_width(uint32_t type)
+{
+	return (type == STAT_SERIES_WHIST) ? STAT_WHIST_NBUCKETS : sizeof(uint64_t);
+}
+
+/* set offsets of columns, returns size of file */
+static inline size_t
+stat_file_layout(struct stat_file_header *h, struct stat_series *s)
+{
+	size_t off, i, collen, align;
+
+	collen = (size_t)h->nrec * sizeof(uint64_t);
+	align = (collen < STAT_FILE_ALIGN) ? STAT_FILE_ALIGN_SHORT : STAT_FILE_ALIGN;
+
+	off = sizeof(struct stat_file_header) + h->nseries * sizeof(struct stat_series);
+	for (i=0; i<h->nseries; i++) {
+		off = (off + align - 1) & ~(align - 1);
+		s[i].offset = off;
+		off += (size_t)h->nrec * stat_series_width(s[i].type);
+	}
+
+	return off;
+}
+
+#endif
+
@@ -0,0 +1,225 @@
+#include "top.h"
+#include "flowtab.h"
+
+struct top_sketch *
+top_create(int fkey, size_t capacity)
+{
+	struct top_sketch *t;
+	size_t nhash;
+
+	t = calloc(1, sizeof(struct top_sketch));
+	if (!t) {
+		fprintf(stderr, "calloc(%lu) failed\n", (long)sizeof(struct top_sketch));
+		goto fail_alloc;
+	}
+
+	/* at most half of hash slots used */
+	for (nhash=1; nhash<capacity*2; nhash<<=1);
+
+	t->fkey = fkey;
+	t->capacity = capacity;
+	t->hmask = nhash - 1;
+
+	t->e = malloc(capacity * sizeof(struct top_entry));
+	t->heap = malloc(capacity * sizeof(uint32_t));
+	t->hash = malloc(nhash * sizeof(int32_t));
+	if (!t->e || !t->heap || !t->hash) {
+		fprintf(stderr, "Can't allocate top talkers sketch for %lu keys\n", (long)capacity);
+		goto fail_tables;
+	}
+
+	top_clear(t);
+
+	return t;
+
+fail_tables:
+	top_destroy(t);
+fail_alloc:
+	return NULL;
+}
+
+void
+top_destroy(struct top_sketch *t)
+{
+	if (!t) {
+		return;
+	}
+	free(t->e);
+	free(t->heap);
+	free(t->hash);
+	free(t);
+}
+
+void
+top_clear(struct top_sketch *t)
+{
+	t->used = 0;
+	memset(t->hash, 0xff, (t->hmask + 1) * sizeof(int32_t));
+}
+
+static void
+top_heap_swap(struct top_sketch *t, uint32_t a, uint32_t b)
+{
+	uint32_t tmp = t->heap[a];
+
+	t->heap[a] = t->heap[b];
+	t->heap[b] = tmp;
+	t->e[t->heap[a]].heap = a;
+	t->e[t->heap[b]].heap = b;
+}
+
+/* octets of entry only grow, so it can only move down */
+static void
+top_heap_down(struct top_sketch *t, uint32_t i)
+{
+	for (;;) {
+		uint32_t l = 2 * i + 1, r = l + 1, m = i;
+
+		if ((l < t->used) && (t->e[t->heap[l]].hoctets < t->e[t->heap[m]].hoctets)) {
+			m = l;
+		}
+		if ((r < t->used) && (t->e[t->heap[r]].hoctets < t->e[t->heap[m]].hoctets)) {
+			m = r;
+		}
+		if (m == i) {
+			break;
+		}
+		top_heap_swap(t, i, m);
+		i = m;
+	}
+}
+
+static void
+top_heap_up(struct top_sketch *t, uint32_t i)
+{
+	while (i > 0) {
+		uint32_t p = (i - 1) / 2;
+
+		if (t->e[t->heap[p]].hoctets <= t->e[t->heap[i]].hoctets) {
+			break;
+		}
+		top_heap_swap(t, i, p);
+		i = p;
+	}
+}
+
+/* entry with minimum octets. octets only grow, so hoctets of each entry
+   is not above its octets, and root is minimal when it is up to date */
+static int32_t
+top_heap_min(struct top_sketch *t)
+{
+	for (;;) {
+		struct top_entry *e = &t->e[t->heap[0]];
+
+		if (e->hoctets == e->octets) {
+			return t->heap[0];
+		}
+		e->hoctets = e->octets;
+		top_heap_down(t, 0);
+	}
+}
+
+static void
+top_unlink(struct top_sketch *t, int32_t idx)
+{
+	int32_t *pp = &t->hash[flow_hash(&t->e[idx].key) & t->hmask];
+
+	while (*pp != idx) {
+		pp = &t->e[*pp].next;
+	}
+	*pp = t->e[idx].next;
+}
+
+void
+top_add(struct top_sketch *t, struct flow_key *key, int size, int pass)
+{
+	struct flow_key k;
+	struct top_entry *e;
+	uint32_t h;
+	int32_t idx;
+
+	flow_key_mask(key, t->fkey, &k);
+	/* conntrack id is not shown, tuple is enough */
+	k.ctid = 0;
+	h = flow_hash(&k) & t->hmask;
+
+	for (idx=t->hash[h]; idx>=0; idx=t->e[idx].next) {
+		if (memcmp(&t->e[idx].key, &k, sizeof(struct flow_key)) == 0) {
+			break;
+		}
+	}
+
+	if (idx < 0) {
+		if (t->used < t->capacity) {
+			/* free counter */
+			idx = t->used;
+			e = &t->e[idx];
+			e->octets = e->hoctets = e->err = 0;
+			e->heap = t->used;
+			t->heap[t->used++] = idx;
+			top_heap_up(t, e->heap);
+		} else {
+			/* take counter with minimum octets, new key inherits them */
+			idx = top_heap_min(t);
+			e = &t->e[idx];
+			top_unlink(t, idx);
+			e->err = e->octets;
+		}
+		e->key = k;
+		e->octets_pass = e->octets_drop = 0;
+		e->packets_pass = e->packets_drop = 0;
+		e->next = t->hash[h];
+		t->hash[h] = idx;
+	}
+
+	e = &t->e[idx];
+	e->octets += size;
+	if (pass) {
+		e->octets_pass += size;
+		e->packets_pass += 1;
+	} else {
+		e->octets_drop += size;
+		e->packets_drop += 1;
+	}
+}
+
+static int
+top_cmp(const void *a, const void *b)
+{
+	const struct top_entry *ea = *(struct top_entry * const *)a;
+	const struct top_entry *eb = *(struct top_entry * const *)b;
+
+	if (ea->octets == eb->octets) {
+		return 0;
+	}
+	return (ea->octets < eb->octets) ? 1 : -1;
+}
+
+size_t
+top_get(struct top_sketch *t, struct top_entry **res, size_t n)
+{
+	struct top_entry **all;
+	size_t i;
+
+	if (t->used == 0) {
+		return 0;
+	}
+
+	all = malloc(t->used * sizeof(struct top_entry *));
+	if (!all) {
+		fprintf(stderr, "malloc(%lu) failed\n", (long)(t->used * sizeof(struct top_entry *)));
+		return 0;
+	}
+	for (i=0; i<t->used; i++) {
+		all[i] = &t->e[i];
+	}
+	qsort(all, t->used, sizeof(struct top_entry *), &top_cmp);
+
+	if (n > t->used) {
+		n = t->used;
+	}
+	memcpy(res, all, n * sizeof(struct top_entry *));
+	free(all);
+
+	return n;
+}
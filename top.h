@@ -0,0 +1,52 @@
+#ifndef top_h_included
+#define top_h_included
+
+#include "damper.h"
+
+/*
+ * top talkers: Space-Saving sketch with fixed number of counters.
+ * key with more than total/capacity octets is always in sketch, its octets
+ * are overestimated by at most 'err'
+ */
+
+#define TOP_CAPACITY_MUL 100   /* counters for each reported key */
+
+struct top_entry
+{
+	struct flow_key key;
+	uint64_t octets;         /* octets of key, includes err */
+	uint64_t err;            /* octets of evicted key this counter inherited */
+	uint64_t octets_pass, octets_drop;   /* since key got counter */
+	uint64_t packets_pass, packets_drop;
+
+	uint64_t hoctets;        /* octets when entry was last ordered in heap */
+	uint32_t heap;           /* position in heap */
+	int32_t next;            /* hash chain */
+};
+
+struct top_sketch
+{
+	int fkey;                /* key fields */
+	size_t capacity, used;
+
+	struct top_entry *e;
+	uint32_t *heap;          /* min-heap of entries by hoctets, updated lazily */
+	int32_t *hash;           /* first entry in chain, -1 if empty */
+	size_t hmask;
+};
+
+struct top_sketch *top_create(int fkey, size_t capacity);
+void top_destroy(struct top_sketch *t);
+
+/* account packet, O(1) for key in sketch. heap is fixed up only when counter
+   is taken for new key, O(log capacity) for each entry grown since then */
+void top_add(struct top_sketch *t, struct flow_key *key, int size, int pass);
+
+/* up to n entries with most octets, sorted */
+size_t top_get(struct top_sketch *t, struct top_entry **res, size_t n);
+
+/* forget all keys */
+void top_clear(struct top_sketch *t);
+
+#endif
+